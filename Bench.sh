@@ -0,0 +1,196 @@
+#!/bin/bash
+#
+# Latency and syscall benchmarks, see "make bench"
+#
+#	./Bench.sh [section..]
+#
+# Sections: exec start handoff fds data pool batch ring intake (default: all)
+#
+# Output is one JSON object per line on STDOUT (p50/p99 etc. in us).
+# BENCH_N sets the number of runs per measurement (default 200).
+# BENCH_MB sets the data volume for the data path (default 256).
+#
+# This Works is placed under the terms of the Copyright Less License,
+# see file COPYRIGHT.CLL.  USE AT OWN RISK, ABSOLUTELY NO WARRANTY.
+
+STDOUT() { local e=$?; printf '%q' "$1"; printf ' %q' "${@:2}"; printf '\n'; return $e; }
+STDERR() { local e=$?; STDOUT "$@" >&2; return $e; }
+OOPS() { STDERR Bench fail: "$@"; exit 23; }
+o() { "$@" || OOPS rc=$?: "$@"; }
+
+B=.tmp/benchtool
+P=./passfd
+F=.tmp/passfd-fast
+N="${BENCH_N:-200}"
+MB="${BENCH_MB:-256}"
+T=.tmp/bench
+S="$T/sock"
+A="@passfd-bench-$$"
+PORT="${BENCH_PORT:-$((20000 + $$ % 20000))}"
+
+[ -x "$B" ] || OOPS missing "$B", run: make bench
+[ -x "$P" ] || OOPS missing "$P", run: make
+mkdir -p "$T" || OOPS cannot create "$T"
+
+LISTENERS=()
+cleanup() { [ 0 = "${#LISTENERS[@]}" ] || kill "${LISTENERS[@]}" 2>/dev/null; rm -f "$S" "$T/listen"; }
+trap cleanup 0
+
+# listen listen|sink SOCK
+listen() { "$B" "$@" & LISTENERS+=($!); }
+
+# run LABEL cmd args..
+run() { o "$B" run "$1" "$N" -- "${@:2}"; }
+# sysc LABEL cmd args..
+sysc() { o "$B" sysc "$1" -- "${@:2}"; }
+
+# both LABEL cmd args..
+both() { run "$@"; sysc "$@"; }
+
+# handoff LABEL MODE SOCK
+handoff()
+{
+  local cmd
+  case "$2" in
+  io)	cmd=("$P" l i "$3" 0 -- "$P" o "$3" 7 -- true);;
+  p)	cmd=("$P" l i "$3" 0 -- "$B" pair 5 6 -- sh -c "$P u 5 p '$3' && exec $P o 6 7 -- true");;
+  d)	cmd=("$B" pair 0 6 -- sh -c "$P d '$3' && exec $P o 6 7 -- true");;
+  b)	cmd=("$B" pair 5 6 -- sh -c "$P u 5 p '$3' && exec $P o 6 7 -- true");;
+  esac
+  both "handoff-$2-$1" "${cmd[@]}"
+}
+
+# fork/exec overhead (baselines for the handoffs below)
+bench-exec()
+{
+  both	exec-true		true
+  both	exec-sh			sh -c true
+  both	exec-pair-sh		"$B" pair 0 6 -- sh -c 'true && exec true'
+}
+
+# handoff latency per mode, filesystem vs. abstract sockets
+bench-handoff()
+{
+  listen listen "$T/listen"
+  listen listen "@passfd-bench-listen-$$"
+  listen listen "$PORT"
+  sleep .2
+
+  handoff	fs		io	"$S"
+  handoff	abstract	io	"$A"
+  handoff	fs		p	"$S"
+  handoff	abstract	p	"$A"
+  handoff	fs		d	"./$T/listen"
+  handoff	abstract	d	"@passfd-bench-listen-$$"
+  handoff	tcp		d	"127.0.0.1:$PORT"
+}
+
+# scaling with FD count (253 is SCM_MAX_FD on Linux)
+bench-fds()
+{
+  local n i src dst
+
+  for n in 1 2 4 8 16 32 64 128 253
+  do
+	src=()
+	dst=()
+	for ((i=0; i<n; i++))
+	do
+		src+=(0)
+		dst+=($((300+i)))
+	done
+	both	"fds-$n"	"$P" l i "$S" "${src[@]}" -- "$P" o "$S" "${dst[@]}" -- true
+  done
+}
+
+# Data path of the README scenarios: passed FD vs. userspace relay.
+# sink is the sshd, client is ssh with ProxyCommand, relay is socat/nc.
+# For data-relay, setup_us ends before the relay has connected.
+bench-data()
+{
+  local port=$((PORT+1))
+
+  listen sink "$port"
+  sleep .2
+
+  o "$B" client data-d fdpass "$MB" "$N" -- "$P" d "127.0.0.1:$port"
+  ( exec 4<>"/dev/tcp/127.0.0.1/$port" && o "$P" l i "$S" 4 -- "$B" client data-ip fdpass "$MB" "$N" -- "$P" p "$S" ) || exit
+  o "$B" client data-relay stream "$MB" "$N" -- "$B" relay "$port"
+}
+
+# Fresh TCP connection (d) vs. warm connection from the pool (b)
+bench-pool()
+{
+  local port=$((PORT+2))
+
+  listen sink "$port"
+  "$P" b "$A-pool" "127.0.0.1:$port" 8 & LISTENERS+=($!)
+  sleep .2
+
+  handoff	sink		d	"127.0.0.1:$port"
+  handoff	pool		b	"$A-pool"
+}
+
+# 20 handoffs from one passfd (j) vs. one passfd per side
+bench-batch()
+{
+  local i ops="$T/ops"
+
+  for ((i=0; i<20; i++))
+  do
+	printf 'l i %s 0\nr 100 o %s 7 -- true\n' "$A-$i" "$A-$i"
+  done > "$ops"
+
+  run	batch-j-20	bash -c '"$1" j "$2" >/dev/null' - "$P" "$ops"
+  run	batch-exec-20	bash -c 'for i in {0..19}; do "$1" l i "$2-$i" 0 -- "$1" o "$2-$i" 7 -- true || exit; done' - "$P" "$A"
+}
+
+# socketpair() vs. 2 shared memory rings, passed with i/o
+bench-ring()
+{
+  o "$B" xfer xfer-socketpair "$MB" "$N"
+  o "$P" l i "$S" ring@3 ring@6 -- "$B" xfer xfer-ring "$MB" "$N" 3 4 5 6 7 8 -- "$P" o "$S" 3 4 5 6 7 8 -- "$B" xserve 3 4 5 6 7 8
+}
+
+# passfd c i into recvpool.h with 1 and 4 workers, and 4 own threads calling recvpool_get()
+bench-intake()
+{
+  local w pid get
+
+  for w in 1 4 4-get
+  do
+	get=; [ "$w" = "${w%-get}" ] || get=get
+	"$B" intake "intake-$w" "$A-intake-$w" "${w%-get}" "$N" $get & pid=$!
+	LISTENERS+=($pid)
+	sleep .2
+	run	"intake-send-$w"	"$P" c i "$A-intake-$w" 0
+	o wait $pid
+  done
+}
+
+# exec to first sendmsg: ./passfd vs. "make fast" (static, -Os)
+bench-start()
+{
+  local p pid label
+
+  for p in "$P" "$F"
+  do
+	[ -x "$p" ] || { STDERR skip "$p", run: make fast; continue; }
+	label="start-${p##*/}"
+	o "$B" start "$label" "$N" "$A-start" -- "$p" c i "$A-start" 0
+	"$B" intake "$label" "$A-start" 1 1 >/dev/null & pid=$!
+	LISTENERS+=($pid)
+	sleep .2
+	sysc	"$label"	"$p" c i "$A-start" 0
+	o wait $pid
+  done
+}
+
+[ 0 = $# ] && set -- exec start handoff fds data pool batch ring intake
+for a
+do
+	declare -F "bench-$a" >/dev/null || OOPS unknown section: "$a"
+	"bench-$a"
+done
+
+:
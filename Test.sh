@@ -10,5 +10,197 @@ S=.tmp/test.sock
 o ./passfd v l i "$S" 0 <<< 'hello world' -- ./passfd v o "$S" 7 -- bash -c 'exec cmp <(echo hello world) - <&7'
 [ -e "$S" ] && OOPS socket still exists: "$S"
 
-:
+T=.tmp/test.trace
+rm -f "$T"
+o env PASSFD_TRACE="json:$T" ./passfd l i "$S" 0 <<< 'trace' -- ./passfd o "$S" 7 -- true
+o grep -q '"ev":"sendmsg","fd":[0-9]*,"arg":1,' "$T"
+o grep -q '"ev":"recvmsg","fd":[0-9]*,"arg":1,' "$T"
+
+M=.tmp/test.metrics
+rm -f "$M"
+o env PASSFD_METRICS="$M" ./passfd l i "$S" 0 <<< 'metrics' -- ./passfd o "$S" 7 -- true
+o grep -q '"why":"exit","mode":"i",.*"accepts":1,.*"fds_sent":1,' "$M"
+o grep -q '"why":"exec","mode":"o",.*"connects":1,.*"fds_recv":1,' "$M"
+
+# fan-in: FDs from two sockets are merged in list order
+o ./passfd l i "$S" 0 <<< 'fan in' -- ./passfd l i "$S.2" 3 3<Test.sh -- ./passfd o "$S,$S.2" 7 8 -- bash -c 'cmp Test.sh - <&8 && exec cmp <(echo fan in) - <&7'
+
+# fan-in: l and a need a single socket, t limits the wait for the FDs
+./passfd l o "$S,$S.2" 7 -- true 2>/dev/null && OOPS l o took a socket list
+o bash -c './passfd t 20000 l o "$1.2" 7 -- true 2>/dev/null & sleep .2
+	timeout 5 ./passfd l i "$1" 0 -- ./passfd t 500 o "$1,$1.2" 7 -- true 2>/dev/null; r=$?; kill $! 2>/dev/null; wait; [ 23 = $r ]' - "$S"
+
+# -1 is no range: unlimited retries, wait without max
+E=.tmp/test.err
+o ./passfd v r -1 w -1 l i "$S" 0 </dev/null 2>"$E" -- ./passfd o "$S" 7 -- true
+o grep -q 'retry set to unlimited' "$E"
+o grep -q 'wait set to max=-1 backoff=10 ' "$E"
+
+# n with fan-in: the nonce is sent to each socket
+o env PASSFD_NONCE=fanin ./passfd n l i "$S" 0 <<< 'nonce fan' -- ./passfd n l i "$S.2" 3 3<Test.sh -- ./passfd n o "$S,$S.2" 7 8 -- bash -c 'cmp Test.sh /dev/fd/8 && exec cmp <(echo nonce fan) - <&7'
+
+# named FDs from two sockets: names and targets are merged in list order
+o ./passfd l i "$S" in/7=0 <<< 'fan names' -- ./passfd l i "$S.2" log/9=3 3<Test.sh -- ./passfd o "$S,$S.2" -- bash -c '[ 7=in:9=log = "$PASSFD_FDNAMES" ] && cmp Test.sh /dev/fd/9 && exec cmp <(echo fan names) - <&7'
+
+# FD ranges, also from the environment
+o env R='3-5' ./passfd l i "$S" '$R' 3<Test.sh 4<<< 'range' 5</dev/null -- ./passfd o "$S" 7-11/2 -- bash -c 'cmp Test.sh /dev/fd/7 && exec cmp <(echo range) - <&9'
+
+J=.tmp/test.batch
+o ./passfd j - 3<Test.sh > "$J" <<EOF
+l i $S 3
+# retry, as the socket may not exist yet
+r 100 o $S 7 -- bash -c 'exec cmp Test.sh - <&7'
+EOF
+o [ 2 = "$(grep -c '^[12]	0	' "$J")" ]
+
+# f f starts the command first, the socket follows on a socketpair
+o ./passfd l i "$S" 0 <<< 'speculative' -- ./passfd l i "$S.2" socketpair@5 -- bash -c '
+	./passfd u 5 f f d "$1" 3 -- ./passfd o 3 4 -- ./passfd o 4 7 -- bash -c "exec cmp <(echo speculative) - <&7" &
+	./passfd o "$1.2" 6 -- ./passfd o 6 7 -- true && wait $!' - "$S"
+
+# f f: when the command fails, the retry hands over the socket the same way (the server is python3)
+rm -rf "$S.spec" "$S.spec.d"
+command -v python3 >/dev/null &&
+o python3 -c '
+import os, socket, subprocess, sys
+s = socket.socket(socket.AF_UNIX); s.bind(sys.argv[1]); s.listen(); s.settimeout(10)
+r, w = os.pipe(); os.write(w, b"retry\n"); os.close(w)
+a, b = socket.socketpair()
+p = subprocess.Popen(["./passfd", "r", "1", "f", "f", "d", sys.argv[1], "3", "--", "bash", "-c",
+	"mkdir \"$0\" 2>/dev/null && exit 1; exec ./passfd o 3 4 -- ./passfd o 4 7 -- bash -c \"exec cmp <(echo retry) - <&7\"", sys.argv[1] + ".d"], stdin=b)
+for i in range(2):
+	c = s.accept()[0]
+	subprocess.run(["./passfd", "c", "i", str(c.fileno()), str(r)], pass_fds=(c.fileno(), r))
+	c.close()
+sys.exit(p.wait(10))' "$S.spec"
+
+# named FDs: without FDs given, o puts them to the targets sent
+o ./passfd l i "$S" in/7=0 <<< 'named' log/9=3 3<Test.sh -- ./passfd o "$S" -- bash -c '[ 7=in:9=log = "$PASSFD_FDNAMES" ] && cmp Test.sh /dev/fd/9 && exec cmp <(echo named) - <&7'
+./passfd l i "$S" a/7=0 b/7=3 3<Test.sh </dev/null -- ./passfd o "$S" -- true 2>/dev/null && OOPS duplicate targets were mapped
+
+# failover over backends which all fail: both are recorded in the RTT cache
+R=.tmp/test.rtt
+rm -f "$R"
+PASSFD_RTTCACHE="$R" ./passfd d '127.0.0.1:1|127.0.0.1:2' -- true 2>/dev/null && OOPS connect to port 1 or 2 did not fail
+o grep -q '^127.0.0.1:1 0 [1-9]' "$R"
+o grep -q '^127.0.0.1:2 0 [1-9]' "$R"
+
+# FD types are Linux only
+[ Linux = "$(uname)" ] || exit 0
+
+o ./passfd l i "$S" memfd <<< 'hello memfd' -- ./passfd o "$S" 7 -- bash -c 'exec cmp <(echo hello memfd) - <&7'
+o ./passfd l i "$S" memfd:Test.sh -- ./passfd o "$S" 7 -- bash -c 'exec cmp Test.sh - <&7'
+o ./passfd l i "$S" pipe,r,size=1M@5 -- bash -c 'echo hello pipe >&5; exec 5>&-; ./passfd o "$1" 7 -- bash -c "exec cmp <(echo hello pipe) - <&7"' - "$S"
+o ./passfd l i "$S" eventfd,init=2,semaphore,nonblock -- ./passfd o "$S" 7 -- bash -c 'exec dd bs=8 count=2 status=none <&7 | cmp <(printf "\1\0\0\0\0\0\0\0\1\0\0\0\0\0\0\0") -'
+o ./passfd l i "$S" ring,size=5000@5 -- ./passfd o "$S" 7 8 9 -- bash -c '[ 12288 = "$(stat -L -c %s /proc/self/fd/7)" ] && [ "$(readlink /proc/self/fd/5)" = "$(readlink /proc/self/fd/7)" ] && exec [ "anon_inode:[eventfd]" = "$(readlink /proc/self/fd/9)" ]'
+
+# @keep on the passed end moves that away, an FD in use is not overwritten
+o ./passfd l i "$S" pipe,r@3 -- bash -c 'echo kept >&3; exec 3>&-; ./passfd o "$1" 7 -- bash -c "exec cmp <(echo kept) - <&7"' - "$S"
+./passfd l i "$S" eventfd@4 -- true 4</dev/null 2>/dev/null && OOPS eventfd@4 overwrote FD 4
 
+# udp: bound and connected socket with GSO/GRO, an SO_REUSEPORT group kept as 5 6
+U=$((20000 + $$ % 20000))
+o ./passfd l i "$S" "udp,gro,rcvbuf=256k:127.0.0.1:$U" "udp,gso=1200:/127.0.0.1:$U" "udp,reuseport=2@5:127.0.0.1:$((U+1))" -- ./passfd o "$S" 7 8 9 10 -- bash -c '
+	echo udp >&8 && [ udp = "$(dd bs=64 count=1 status=none <&7)" ] && [ -S /proc/self/fd/5 ] && exec [ "$(readlink /proc/self/fd/6)" = "$(readlink /proc/self/fd/10)" ]'
+
+# fan-out to a socketpair and a non-socket: partial failure gives 1
+o ./passfd l i "$S" 0 <<< 'fan out' -- ./passfd l i "$S.2" socketpair@5 -- bash -c '
+	./passfd o "$1.2" 8 -- ./passfd o 8 7 -- bash -c "exec cmp <(echo fan out) - <&7" &
+	./passfd u 5 6 p "$1" 6>/dev/null 2>/dev/null; [ 1 = $? ] && wait $!' - "$S"
+
+# k p is a persistent relay: each sender is a stream, the batches are counted
+rm -f .tmp/test.metrics
+o ./passfd l i "$S.2" socketpair@5 -- bash -c '
+	PASSFD_METRICS=.tmp/test.metrics ./passfd u 5 l k p "$1" &
+	./passfd r 100 c i "$1" 3 3<Test.sh && ./passfd c i "$1" 0 <<< relay &&
+	./passfd o "$1.2" 8 -- bash -c "./passfd o 8 7 -- cmp Test.sh /dev/fd/7 && exec ./passfd o 8 7 -- bash -c \"exec cmp <(echo relay) - <&7\""
+	r=$?; kill $!; wait; exit $r' - "$S"
+o grep -q '"batches_sent":2,"batches_recv":2' .tmp/test.metrics
+
+# k p with n: a sender which does not send the nonce does not stall the others
+o ./passfd l i "$S.2" socketpair@5 -- bash -c '
+	PASSFD_NONCE=relay ./passfd t 20000 u 5 n l k p "$1" & r=$!
+	./passfd r 100 c o "$1" 7 -- true 2>/dev/null & s=$!
+	sleep .2
+	PASSFD_NONCE=relay ./passfd r 100 n c i "$1" 0 <<< "nonce relay" &&
+	timeout 5 ./passfd o "$1.2" 8 -- ./passfd o 8 7 -- bash -c "exec cmp <(echo nonce relay) - <&7"
+	e=$?; kill $r $s; wait; exit $e' - "$S"
+
+# k p sorts each batch by the same keys: 5 3 puts the second FD sent first
+o ./passfd l i "$S.2" socketpair@5 -- bash -c '
+	./passfd u 5 l k p "$1" 5 3 &
+	./passfd r 100 c i "$1" 3 4 3<Test.sh 4</dev/null && ./passfd c i "$1" 3 4 3<Test.sh 4</dev/null &&
+	./passfd o "$1.2" 8 -- bash -c "./passfd o 8 7 9 -- cmp Test.sh /dev/fd/9 && exec ./passfd o 8 7 9 -- cmp Test.sh /dev/fd/9"
+	r=$?; kill $!; wait; exit $r' - "$S"
+
+# d to two sockets at once passes both in one message
+o ./passfd l i "$S" 0 <<< 'multi' -- ./passfd l i "$S.2" 3 3<Test.sh -- ./passfd l i "$S.3" socketpair@5 -- bash -c '
+	./passfd u 5 d "$1,$1.2" &
+	./passfd o "$1.3" 6 -- ./passfd o 6 7 8 -- bash -c "./passfd o 7 9 -- cmp <(echo multi) /dev/fd/9 && exec ./passfd o 8 9 -- cmp Test.sh /dev/fd/9" && wait $!' - "$S"
+
+# PASSFD_SUPERVISOR gets the pidfd of the command and the socket
+o ./passfd l i "$S" 0 <<< 'supervisor' -- bash -c '
+	PASSFD_SUPERVISOR="$1.sup" ./passfd d "$1" -- true &
+	exec ./passfd l o "$1.sup" 7 8 -- bash -c "[ anon_inode:[pidfd] = \"\$(readlink /proc/self/fd/7)\" ] && exec ./passfd o 8 9 -- cmp <(echo supervisor) /dev/fd/9"' - "$S"
+
+# socket @ and n: random abstract name and nonce in the environment, a wrong nonce is dropped
+o ./passfd n l i @ 0 <<< 'nonce' -- bash -c '[ -n "$PASSFD_NONCE" ] && [ -z "${PASSFD_SOCK%%@passfd-*}" ] &&
+	! PASSFD_NONCE=wrong ./passfd n o @ 7 -- true 2>/dev/null && exec ./passfd n o @ 7 -- bash -c "exec cmp <(echo nonce) - <&7"'
+
+# m: MPTCP over loopback if the kernel has it enabled (python3 is the MPTCP server)
+[ 1 = "$(cat /proc/sys/net/mptcp/enabled 2>/dev/null)" ] && python3 -c 'import socket; socket.IPPROTO_MPTCP' 2>/dev/null &&
+o python3 -c '
+import socket, subprocess, sys
+s = socket.socket(socket.AF_INET, socket.SOCK_STREAM, socket.IPPROTO_MPTCP)
+s.bind(("127.0.0.1", 0)); s.listen()
+a, b = socket.socketpair()
+p = subprocess.run(["./passfd", "v", "m", "d", "127.0.0.1:%d" % s.getsockname()[1]], stdin=b, stderr=subprocess.PIPE)
+sys.exit(p.returncode or b": MPTCP\n" not in p.stderr or len(socket.recv_fds(a, 1, 1)[1]) != 1)'
+
+# d with several destinations binds each socket: a foreign @bind fails, 127.0.0.2 is seen by the server
+command -v python3 >/dev/null &&
+o python3 -c '
+import socket, subprocess, sys
+s = socket.socket(); s.bind(("127.0.0.1", 0)); s.listen(); s.settimeout(10)
+d = "127.0.0.1:%d" % s.getsockname()[1]
+if not subprocess.run(["./passfd", "w", "0", "0", "0", "0", "0", "d", d + "," + d + "@192.0.2.1", "--", "true"], stderr=subprocess.DEVNULL).returncode:
+	sys.exit(1)
+a, b = socket.socketpair()
+p = subprocess.run(["./passfd", "d", d + "," + d + "@127.0.0.2", "--", "true"], stdin=b)
+sys.exit(p.returncode or len(socket.recv_fds(a, 1, 2)[1]) != 2 or "127.0.0.2" not in [s.accept()[1][0] for i in range(3)])'
+
+# j: the number of parallel operations is a single number, too
+./passfd j - 2-9 </dev/null 2>/dev/null && OOPS j took 2-9 as maximum
+
+# b: the number of connections is a single number, not an FD list
+./passfd b "$S.pool" 127.0.0.1:1 2-9 2>/dev/null && OOPS b took 2-9 as pool size
+./passfd b "$S.pool" 127.0.0.1:1 2 3 2>/dev/null && OOPS b took extra FDs
+
+# b: clients get live connections, the pool is refilled, connections closed by the peer are dropped
+command -v python3 >/dev/null &&
+o python3 -c '
+import socket, subprocess, sys
+s = socket.socket(); s.bind(("127.0.0.1", 0)); s.listen(); s.settimeout(10)
+b = subprocess.Popen(["./passfd", "b", sys.argv[1], "127.0.0.1:%d" % s.getsockname()[1], "2"])
+def get():
+	return subprocess.run(["./passfd", "o", sys.argv[1], "7", "--", "sh", "-c", "exec head -n1 <&7"], stdout=subprocess.PIPE, timeout=10).stdout
+try:
+	c = [s.accept()[0] for i in range(2)]
+	c.pop(0).close()			# dropped and dialed again
+	c.append(s.accept()[0])
+	for x in c: x.sendall(b"live\n")
+	ok = get() == b"live\n"
+	c.append(s.accept()[0])			# refilled after handing out
+	c[-1].sendall(b"live\n")
+	sys.exit(not ok or get() != b"live\n")
+finally:
+	b.kill()' "$S.pool"
+
+# PASSFD_NETNS: listener in the outer namespace (FD 9) is invisible in the inner one
+unshare -rn true 2>/dev/null &&
+o unshare -rn bash -c 'exec 9</proc/self/ns/net; exec unshare -n bash -c '\''
+	PASSFD_NETNS=9 ./passfd l i @passfd-test-netns-$$ 0 <<< netns -- bash -c "
+	! env -u PASSFD_NETNS ./passfd w 0 0 0 0 0 o @passfd-test-netns-$$ 7 -- true 2>/dev/null &&
+	exec ./passfd o @passfd-test-netns-$$ 7 -- bash -c \"exec cmp <(echo netns) - <&7\""'\'
+
+:
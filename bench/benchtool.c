@@ -0,0 +1,1114 @@
+/* Benchmark helper for Bench.sh
+ *
+ * This Works is placed under the terms of the Copyright Less License,
+ * see file COPYRIGHT.CLL.  USE AT OWN RISK, ABSOLUTELY NO WARRANTY.
+ *
+ * This is not installed.  It is built by "make bench" into .tmp/
+ *
+ *	benchtool run LABEL N -- cmd args..
+ *		run cmd N times, print latency as JSON line
+ *	benchtool sysc LABEL -- cmd args..
+ *		count syscalls of cmd (and all children) via ptrace
+ *	benchtool pair FD1 FD2 -- cmd args..
+ *		exec cmd with a socketpair() at FD1 and FD2
+ *	benchtool start LABEL N SOCK -- cmd args..
+ *		run cmd N times, print latency from fork() to the first FDs on SOCK
+ *	benchtool listen SOCK
+ *		accept() and close() forever on path, @abstract or tcp port
+ *	benchtool sink SOCK
+ *		sshd stand-in for client, see below
+ *	benchtool relay PORT
+ *		socat/nc stand-in: pump STDIN/STDOUT to 127.0.0.1:PORT
+ *	benchtool client LABEL fdpass|stream MB MSGS -- proxycmd args..
+ *		ssh stand-in: run proxycmd like ssh's ProxyCommand,
+ *		print setup time, latency, throughput and CPU per GB
+ *	benchtool xfer LABEL MB MSGS
+ *		latency and throughput over a socketpair() to a forked echo server
+ *	benchtool xfer LABEL MB MSGS FD1..FD6 -- cmd args..
+ *		same over 2 shared memory rings (shmring.h, FD1..3 to cmd, FD4..6 back),
+ *		cmd is the echo server, usually "passfd o SOCK FD1..FD6 -- benchtool xserve FD1..FD6"
+ *	benchtool xserve FD1..FD6
+ *		echo server of xfer over the rings
+ *	benchtool intake LABEL SOCK WORKERS N [get]
+ *		server stand-in: receive N FDs on SOCK with recvpool.h,
+ *		print throughput and how the FDs were spread over the workers,
+ *		with get the workers are own threads calling recvpool_get()
+ */
+
+#define	_GNU_SOURCE
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <signal.h>
+#include <poll.h>
+#include <stdint.h>
+#include <stddef.h>
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <sys/un.h>
+#include <sys/resource.h>
+#include <netinet/in.h>
+#include <sys/syscall.h>
+
+#include "../recvpool.h"
+#include "../shmring.h"
+
+#ifdef	__linux__
+#include <sys/ptrace.h>
+#include <linux/ptrace.h>
+#endif
+
+static const char	*arg0;
+
+static void
+OOPS(const char *s, ...)
+{
+  int		e = errno;
+  va_list	list;
+
+  fprintf(stderr, "OOPS: %s: ", arg0);
+  va_start(list, s);
+  vfprintf(stderr, s, list);
+  va_end(list);
+  if (e)
+    fprintf(stderr, ": %s", strerror(e));
+  fprintf(stderr, "\n");
+  exit(23);
+}
+
+static int
+num(const char *s)
+{
+  char	*end;
+  long	l;
+
+  l	= strtol(s, &end, 0);
+  if (!*s || *end || l<0 || l>1000000000)
+    {
+      errno	= 0;
+      OOPS("not a number: %s", s);
+    }
+  return l;
+}
+
+/* skip the mandatory -- before cmd	*/
+static char **
+cmd(char **argv)
+{
+  if (!*argv || strcmp(*argv, "--") || !argv[1])
+    {
+      errno	= 0;
+      OOPS("missing -- cmd args..");
+    }
+  return argv+1;
+}
+
+static uint64_t
+now(void)
+{
+  struct timespec	ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static int
+u64cmp(const void *a, const void *b)
+{
+  uint64_t	x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+  return x<y ? -1 : x>y;
+}
+
+/* p-th percentile, nearest rank	*/
+static double
+pct(uint64_t *v, int n, int p)
+{
+  int	i;
+
+  i	= (n * p + 99) / 100;
+  if (i<1)
+    i	= 1;
+  return v[i-1] / 1000.0;
+}
+
+static int
+spawn(char **argv)
+{
+  pid_t	pid;
+  int	st;
+
+  pid	= fork();
+  if (pid == (pid_t)-1)
+    OOPS("fork()");
+  if (!pid)
+    {
+      execvp(argv[0], argv);
+      OOPS("exec %s", argv[0]);
+    }
+  while (waitpid(pid, &st, 0) == (pid_t)-1)
+    if (errno != EINTR)
+      OOPS("waitpid()");
+  return st;
+}
+
+/* print the latencies v[n] as JSON line and free v	*/
+static void
+latency(const char *label, uint64_t *v, int n, uint64_t sum)
+{
+  qsort(v, n, sizeof *v, u64cmp);
+  printf("{\"bench\":\"%s\",\"n\":%d,\"min_us\":%.1f,\"p50_us\":%.1f,\"p90_us\":%.1f,\"p99_us\":%.1f,\"max_us\":%.1f,\"mean_us\":%.1f}\n"
+        , label, n, pct(v, n, 0), pct(v, n, 50), pct(v, n, 90), pct(v, n, 99), pct(v, n, 100), sum / 1000.0 / n);
+  free(v);
+}
+
+static int
+b_run(char **argv)
+{
+  const char	*label;
+  uint64_t	*v, sum;
+  int		n, i;
+
+  if (!argv[0] || !argv[1])
+    OOPS("usage: run LABEL N -- cmd args..");
+  label	= argv[0];
+  n	= num(argv[1]);
+  argv	= cmd(argv+2);
+  if (n<1)
+    n	= 1;
+
+  v	= malloc(n * sizeof *v);
+  if (!v)
+    OOPS("out of memory");
+
+  sum	= 0;
+  for (i=0; i<n; i++)
+    {
+      uint64_t	t;
+      int	st;
+
+      t		= now();
+      st	= spawn(argv);
+      v[i]	= now() - t;
+      sum	+= v[i];
+      if (st)
+        {
+          errno	= 0;
+          OOPS("%s: run %d: %s failed with status %d", label, i, argv[0], st);
+        }
+    }
+  latency(label, v, n, sum);
+  return 0;
+}
+
+static int
+b_pair(char **argv)
+{
+  int	sp[2], a, b;
+
+  if (!argv[0] || !argv[1])
+    OOPS("usage: pair FD1 FD2 -- cmd args..");
+  a	= num(argv[0]);
+  b	= num(argv[1]);
+  argv	= cmd(argv+2);
+  if (a == b)
+    OOPS("FDs must differ");
+
+  if (socketpair(AF_UNIX, SOCK_STREAM, 0, sp))
+    OOPS("socketpair()");
+  /* avoid clobbering when sp[] already sits on a or b	*/
+  if (sp[0] == b || sp[1] == a)
+    {
+      int	t;
+
+      t		= sp[0];
+      sp[0]	= sp[1];
+      sp[1]	= t;
+    }
+  if (sp[0] != a && (dup2(sp[0], a)<0 || close(sp[0])))
+    OOPS("dup2(%d, %d)", sp[0], a);
+  if (sp[1] != b && (dup2(sp[1], b)<0 || close(sp[1])))
+    OOPS("dup2(%d, %d)", sp[1], b);
+  execvp(argv[0], argv);
+  OOPS("exec %s", argv[0]);
+  return 23;
+}
+
+/* Unix socket (path or @abstract) or TCP port on 127.0.0.1
+ */
+static int
+listener(const char *name)
+{
+  union
+    {
+      struct sockaddr		sa;
+      struct sockaddr_un	un;
+      struct sockaddr_in	in;
+    }		a;
+  socklen_t	len;
+  int		fd, on = 1;
+
+  memset(&a, 0, sizeof a);
+  if (*name >= '0' && *name <= '9')
+    {
+      a.in.sin_family		= AF_INET;
+      a.in.sin_port		= htons(num(name));
+      a.in.sin_addr.s_addr	= htonl(INADDR_LOOPBACK);
+      len			= sizeof a.in;
+    }
+  else
+    {
+      if (strlen(name) >= sizeof a.un.sun_path)
+        OOPS("socket name too long: %s", name);
+      a.un.sun_family	= AF_UNIX;
+      strcpy(a.un.sun_path, name);
+      if (*name == '@')
+        a.un.sun_path[0]	= 0;
+      else
+        unlink(name);
+      len	= offsetof(struct sockaddr_un, sun_path) + strlen(name);
+    }
+  fd	= socket(a.sa.sa_family, SOCK_STREAM, 0);
+  if (fd<0)
+    OOPS("socket()");
+  setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof on);
+  if (bind(fd, &a.sa, len) || listen(fd, 128))
+    OOPS("cannot listen on %s", name);
+  return fd;
+}
+
+static int
+b_listen(char **argv)
+{
+  int	fd;
+
+  if (!argv[0])
+    OOPS("usage: listen SOCK");
+  fd	= listener(argv[0]);
+  for (;;)
+    {
+      int	c;
+
+      c	= accept(fd, NULL, NULL);
+      if (c>=0)
+        close(c);
+      else if (errno != EINTR && errno != ECONNABORTED)
+        OOPS("accept()");
+    }
+  return 23;
+}
+
+/* Like run, but stop the clock when the first FD arrives on SOCK,
+ * so the exit of cmd does not count (exec to first sendmsg)
+ */
+static int
+b_start(char **argv)
+{
+  const char	*label;
+  uint64_t	*v, sum;
+  int		n, i, fd;
+
+  if (!argv[0] || !argv[1] || !argv[2])
+    OOPS("usage: start LABEL N SOCK -- cmd args..");
+  label	= argv[0];
+  n	= num(argv[1]);
+  fd	= listener(argv[2]);
+  argv	= cmd(argv+3);
+  if (n<1)
+    n	= 1;
+
+  v	= malloc(n * sizeof *v);
+  if (!v)
+    OOPS("out of memory");
+
+  sum	= 0;
+  for (i=0; i<n; i++)
+    {
+      const char	*e = "accept()";
+      int		fds[PFDWIRE_MAX], k, c, st;
+      uint64_t		t;
+      pid_t		pid;
+
+      t		= now();
+      pid	= fork();
+      if (pid == (pid_t)-1)
+        OOPS("fork()");
+      if (!pid)
+        {
+          close(fd);
+          execvp(argv[0], argv);
+          OOPS("exec %s", argv[0]);
+        }
+      while ((c = accept(fd, NULL, NULL))<0 && errno == EINTR);
+      k	= -1;
+      if (c>=0)
+        while ((k = pfdwire_recv(c, fds, PFDWIRE_MAX, 0, &e, NULL))<0 && errno == EINTR);
+      if (k<=0)
+        OOPS("%s: run %d: %s", label, i, k ? e : "EOF");
+      v[i]	= now() - t;
+      sum	+= v[i];
+      while (--k>=0)
+        close(fds[k]);
+      close(c);
+      while (waitpid(pid, &st, 0) == (pid_t)-1)
+        if (errno != EINTR)
+          OOPS("waitpid()");
+      if (st)
+        {
+          errno	= 0;
+          OOPS("%s: run %d: %s failed with status %d", label, i, argv[0], st);
+        }
+    }
+  close(fd);
+  latency(label, v, n, sum);
+  return 0;
+}
+
+/***********************************************************************
+ * Data path: sink (sshd stand-in), relay (nc stand-in), client (ssh stand-in)
+ *
+ * Protocol on the connection (client -> sink):
+ * - MSG byte blocks which are echoed (latency), first byte is not '!'
+ *   (EOF instead of the first block is just a closed connection)
+ * - a MSG byte block starting with '!' (not echoed)
+ * - arbitrary data until EOF (throughput), sink replies 8 byte count
+ **********************************************************************/
+
+#define	MSG	64
+#define	BUF	65536
+
+static void
+full(int fd, void *buf, size_t len, int wr)
+{
+  char	*p = buf;
+
+  while (len)
+    {
+      ssize_t	got;
+
+      got	= wr ? write(fd, p, len) : read(fd, p, len);
+      if (got<0 && errno == EINTR)
+        continue;
+      if (got<=0)
+        {
+          if (!got)
+            errno	= 0;
+          OOPS("short %s on %d", wr ? "write" : "read", fd);
+        }
+      p		+= got;
+      len	-= got;
+    }
+}
+
+static void
+sink(int fd)
+{
+  char		buf[BUF];
+  uint64_t	total;
+
+  for (;;)
+    {
+      ssize_t	got;
+
+      /* EOF before the first block: handoff benchmarks just connect	*/
+      while ((got = recv(fd, buf, 1, MSG_PEEK))<0 && errno == EINTR);
+      if (!got)
+        return;
+      full(fd, buf, MSG, 0);
+      if (buf[0] == '!')
+        break;
+      full(fd, buf, MSG, 1);
+    }
+  total	= 0;
+  for (;;)
+    {
+      ssize_t	got;
+
+      got	= read(fd, buf, sizeof buf);
+      if (got<0 && errno == EINTR)
+        continue;
+      if (got<0)
+        OOPS("read()");
+      if (!got)
+        break;
+      total	+= got;
+    }
+  full(fd, &total, sizeof total, 1);
+}
+
+static int
+b_sink(char **argv)
+{
+  int	fd;
+
+  if (!argv[0])
+    OOPS("usage: sink SOCK");
+  fd	= listener(argv[0]);
+  signal(SIGCHLD, SIG_IGN);
+  for (;;)
+    {
+      int	c;
+
+      c	= accept(fd, NULL, NULL);
+      if (c<0)
+        {
+          if (errno != EINTR && errno != ECONNABORTED)
+            OOPS("accept()");
+          continue;
+        }
+      switch (fork())
+        {
+        case -1:	OOPS("fork()");
+        case 0:		close(fd); sink(c); _exit(0);
+        }
+      close(c);
+    }
+  return 23;
+}
+
+/* socat/nc stand-in: pump STDIN to 127.0.0.1:port and back to STDOUT
+ */
+static int
+b_relay(char **argv)
+{
+  struct sockaddr_in	in;
+  struct pollfd		p[2];
+  char			buf[BUF];
+  int			fd, open;
+
+  if (!argv[0])
+    OOPS("usage: relay PORT");
+  memset(&in, 0, sizeof in);
+  in.sin_family		= AF_INET;
+  in.sin_port		= htons(num(argv[0]));
+  in.sin_addr.s_addr	= htonl(INADDR_LOOPBACK);
+  fd	= socket(AF_INET, SOCK_STREAM, 0);
+  if (fd<0 || connect(fd, (struct sockaddr *)&in, sizeof in))
+    OOPS("cannot connect to port %s", argv[0]);
+
+  p[0].fd	= 0;
+  p[1].fd	= fd;
+  open		= 2;
+  while (open)
+    {
+      int	i;
+
+      p[0].events	= p[0].fd>=0 ? POLLIN : 0;
+      p[1].events	= p[1].fd>=0 ? POLLIN : 0;
+      if (poll(p, 2, -1)<0)
+        {
+          if (errno == EINTR)
+            continue;
+          OOPS("poll()");
+        }
+      for (i=0; i<2; i++)
+        {
+          ssize_t	got;
+
+          if (p[i].fd<0 || !p[i].revents)
+            continue;
+          got	= read(p[i].fd, buf, sizeof buf);
+          if (got<0 && errno == EINTR)
+            continue;
+          if (got>0)
+            {
+              full(i ? 1 : fd, buf, got, 1);
+              continue;
+            }
+          /* EOF: pass on the half close	*/
+          if (i)
+            close(1);
+          else
+            shutdown(fd, SHUT_WR);
+          p[i].fd	= -1;
+          open--;
+        }
+    }
+  return 0;
+}
+
+static double
+cpu(int who)
+{
+  struct rusage	ru;
+
+  getrusage(who, &ru);
+  return ru.ru_utime.tv_sec + ru.ru_stime.tv_sec + (ru.ru_utime.tv_usec + ru.ru_stime.tv_usec) / 1000000.0;
+}
+
+/* Receive the first FD passed like ssh with ProxyUseFDPass does
+ */
+static int
+recvfd(int sock)
+{
+  union
+    {
+      struct cmsghdr	align;
+      char		buf[CMSG_SPACE(255 * sizeof(int))];
+    }			u;
+  struct msghdr		msg = { 0 };
+  struct iovec		io;
+  struct cmsghdr	*cmsg;
+  char			data[64];
+  ssize_t		got;
+  int			fd;
+
+  io.iov_base		= data;
+  io.iov_len		= sizeof data;
+  msg.msg_iov		= &io;
+  msg.msg_iovlen	= 1;
+  msg.msg_control	= &u;
+  msg.msg_controllen	= sizeof u;
+  while ((got = recvmsg(sock, &msg, 0))<0)
+    if (errno != EINTR)
+      OOPS("recvmsg()");
+  cmsg	= CMSG_FIRSTHDR(&msg);
+  if (!got || !cmsg || cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS)
+    {
+      errno	= 0;
+      OOPS("no FD received");
+    }
+  memcpy(&fd, CMSG_DATA(cmsg), sizeof fd);
+  return fd;
+}
+
+/* ssh stand-in: start proxy cmd on a socketpair, use passed FD (fd) or the socketpair (stream)
+ */
+static int
+b_client(char **argv)
+{
+  const char	*label, *how;
+  uint64_t	bytes, total, t0, t1, t2, *lat;
+  char		buf[BUF];
+  int		sp[2], fd, msgs, i, st;
+  pid_t		pid;
+  double	c0, c1, k0, k1, gb, secs;
+
+  if (!argv[0] || !argv[1] || !argv[2] || !argv[3])
+    OOPS("usage: client LABEL fdpass|stream MB MSGS -- proxycmd args..");
+  label	= argv[0];
+  how	= argv[1];
+  bytes	= (uint64_t)num(argv[2]) << 20;
+  msgs	= num(argv[3]);
+  argv	= cmd(argv+4);
+  if (strcmp(how, "fdpass") && strcmp(how, "stream"))
+    OOPS("unknown client type: %s", how);
+
+  lat	= malloc((msgs+1) * sizeof *lat);
+  if (!lat)
+    OOPS("out of memory");
+
+  c0	= cpu(RUSAGE_SELF);
+  k0	= cpu(RUSAGE_CHILDREN);
+  t0	= now();
+  if (socketpair(AF_UNIX, SOCK_STREAM, 0, sp))
+    OOPS("socketpair()");
+  pid	= fork();
+  if (pid == (pid_t)-1)
+    OOPS("fork()");
+  if (!pid)
+    {
+      close(sp[0]);
+      if (dup2(sp[1], 0)<0 || dup2(sp[1], 1)<0)
+        OOPS("dup2()");
+      close(sp[1]);
+      execvp(argv[0], argv);
+      OOPS("exec %s", argv[0]);
+    }
+  close(sp[1]);
+
+  fd	= sp[0];
+  if (*how == 'f')
+    {
+      fd	= recvfd(sp[0]);
+      close(sp[0]);
+      while (waitpid(pid, &st, 0) == (pid_t)-1)
+        if (errno != EINTR)
+          OOPS("waitpid()");
+      if (st)
+        {
+          errno	= 0;
+          OOPS("%s: proxy %s failed with status %d", label, argv[0], st);
+        }
+      pid	= 0;
+    }
+  t1	= now();
+
+  /* latency	*/
+  memset(buf, 'x', MSG);
+  for (i=0; i<msgs; i++)
+    {
+      uint64_t	t;
+
+      t		= now();
+      full(fd, buf, MSG, 1);
+      full(fd, buf, MSG, 0);
+      lat[i]	= now() - t;
+    }
+  buf[0]	= '!';
+  full(fd, buf, MSG, 1);
+
+  /* throughput	*/
+  memset(buf, 'y', sizeof buf);
+  t2	= now();
+  for (total=0; total<bytes; total+=sizeof buf)
+    full(fd, buf, sizeof buf, 1);
+  shutdown(fd, SHUT_WR);
+  full(fd, &total, sizeof total, 0);
+  secs	= (now() - t2) / 1e9;
+  if (total < bytes)
+    {
+      errno	= 0;
+      OOPS("%s: sink got %llu of %llu bytes", label, (unsigned long long)total, (unsigned long long)bytes);
+    }
+  close(fd);
+
+  if (pid)
+    while (waitpid(pid, &st, 0) == (pid_t)-1)
+      if (errno != EINTR)
+        OOPS("waitpid()");
+  c1	= cpu(RUSAGE_SELF);
+  k1	= cpu(RUSAGE_CHILDREN);
+
+  qsort(lat, msgs, sizeof *lat, u64cmp);
+  gb	= total / 1e9;
+  printf("{\"bench\":\"%s\",\"setup_us\":%.1f,\"msgs\":%d,\"lat_p50_us\":%.1f,\"lat_p99_us\":%.1f,\"mb\":%llu,\"mb_per_s\":%.1f,\"client_cpu_s_per_gb\":%.3f,\"proxy_cpu_s_per_gb\":%.3f}\n"
+        , label, (t1 - t0) / 1000.0, msgs, msgs ? pct(lat, msgs, 50) : 0, msgs ? pct(lat, msgs, 99) : 0
+        , (unsigned long long)(total >> 20), total / 1e6 / secs, (c1 - c0) / gb, (k1 - k0) / gb);
+  free(lat);
+  return 0;
+}
+
+#ifdef	PTRACE_GET_SYSCALL_INFO
+
+#define	MAXSYS	1024
+
+/* syscalls which are reported individually	*/
+static const struct { int nr; const char *name; } sysnames[] =
+  {
+#define	S(X)	{ SYS_##X, #X },
+#ifdef	SYS_fork
+    S(fork)
+#endif
+    S(clone)
+#ifdef	SYS_clone3
+    S(clone3)
+#endif
+    S(execve)
+    S(wait4)
+    S(socket)
+    S(bind)
+    S(listen)
+    S(accept)
+    S(accept4)
+    S(connect)
+    S(sendmsg)
+    S(recvmsg)
+    S(getsockopt)
+    S(fcntl)
+    S(dup2)
+    S(dup3)
+    S(close)
+#ifdef	SYS_poll
+    S(poll)
+#endif
+    S(ppoll)
+#ifdef	SYS_lstat
+    S(lstat)
+#endif
+    S(newfstatat)
+#ifdef	SYS_unlink
+    S(unlink)
+#endif
+    S(unlinkat)
+    S(write)
+    S(mmap)
+#undef	S
+  };
+
+static int
+b_sysc(char **argv)
+{
+  const char	*label;
+  unsigned long	count[MAXSYS], total, other;
+  pid_t		pid;
+  int		st, i, ret;
+
+  if (!argv[0])
+    OOPS("usage: sysc LABEL -- cmd args..");
+  label	= argv[0];
+  argv	= cmd(argv+1);
+
+  pid	= fork();
+  if (pid == (pid_t)-1)
+    OOPS("fork()");
+  if (!pid)
+    {
+      if (ptrace(PTRACE_TRACEME, 0, 0, 0))
+        OOPS("ptrace(TRACEME)");
+      raise(SIGSTOP);
+      execvp(argv[0], argv);
+      OOPS("exec %s", argv[0]);
+    }
+  if (waitpid(pid, &st, 0) != pid || !WIFSTOPPED(st))
+    OOPS("child did not stop");
+  if (ptrace(PTRACE_SETOPTIONS, pid, 0, PTRACE_O_TRACESYSGOOD|PTRACE_O_TRACEFORK|PTRACE_O_TRACEVFORK|PTRACE_O_TRACECLONE|PTRACE_O_EXITKILL))
+    OOPS("ptrace(SETOPTIONS)");
+  ptrace(PTRACE_SYSCALL, pid, 0, 0);
+
+  memset(count, 0, sizeof count);
+  total	= 0;
+  ret	= 0;
+  for (;;)
+    {
+      struct ptrace_syscall_info	info;
+      pid_t				p;
+      int				sig;
+
+      p	= waitpid(-1, &st, __WALL);
+      if (p == (pid_t)-1)
+        {
+          if (errno == EINTR)
+            continue;
+          if (errno == ECHILD)
+            break;
+          OOPS("waitpid()");
+        }
+      if (WIFEXITED(st) || WIFSIGNALED(st))
+        {
+          if (p == pid)
+            ret	= st;
+          continue;
+        }
+      if (!WIFSTOPPED(st))
+        continue;
+
+      sig	= WSTOPSIG(st);
+      if (sig == (SIGTRAP|0x80))
+        {
+          sig	= 0;
+          if (ptrace(PTRACE_GET_SYSCALL_INFO, p, (void *)sizeof info, &info) > 0 && info.op == PTRACE_SYSCALL_INFO_ENTRY)
+            {
+              total++;
+              if (info.entry.nr < MAXSYS)
+                count[info.entry.nr]++;
+            }
+        }
+      else if (sig == SIGTRAP || sig == SIGSTOP)
+        sig	= 0;	/* ptrace events and initial stop of new children	*/
+      ptrace(PTRACE_SYSCALL, p, 0, sig);
+    }
+
+  printf("{\"bench\":\"%s\",\"syscalls\":%lu", label, total);
+  other	= total;
+  for (i=0; i<(int)(sizeof sysnames / sizeof *sysnames); i++)
+    if (count[sysnames[i].nr])
+      {
+        printf(",\"%s\":%lu", sysnames[i].name, count[sysnames[i].nr]);
+        other	-= count[sysnames[i].nr];
+      }
+  printf(",\"other\":%lu}\n", other);
+  if (ret)
+    {
+      errno	= 0;
+      OOPS("%s: %s failed with status %d", label, argv[0], ret);
+    }
+  return 0;
+}
+
+#else
+
+static int
+b_sysc(char **argv)
+{
+  printf("{\"bench\":\"%s\",\"syscalls\":null}\n", argv[0] ? argv[0] : "");
+  return 0;
+}
+
+#endif
+
+/***********************************************************************
+ * Shared memory ring (shmring.h) vs. socketpair()
+ *
+ * Protocol (client -> server):
+ * - MSG byte blocks which are echoed (latency), first byte is not '!'
+ * - a MSG byte block starting with '!' (not echoed)
+ * - 8 byte count, count bytes (throughput), server replies the count
+ **********************************************************************/
+
+struct xport
+  {
+    int			fd;	/* -1: use the rings	*/
+    struct shmring	tx, rx;
+  };
+
+static void
+xsend(struct xport *x, const void *buf, size_t len)
+{
+  if (x->fd>=0)
+    full(x->fd, (void *)buf, len, 1);
+  else if (shmring_send(&x->tx, buf, len))
+    OOPS("shmring_send()");
+}
+
+static void
+xrecv(struct xport *x, void *buf, size_t len)
+{
+  if (x->fd>=0)
+    full(x->fd, buf, len, 0);
+  else if (shmring_recv(&x->rx, buf, len))
+    OOPS("shmring_recv()");
+}
+
+/* tx uses fds[0..2], rx fds[3..5]	*/
+static void
+xrings(struct xport *x, char **argv, int swap)
+{
+  int	f[6], i;
+
+  for (i=0; i<6; i++)
+    {
+      if (!argv[i])
+        OOPS("6 FDs needed");
+      f[i]	= num(argv[i]);
+    }
+  x->fd	= -1;
+  if (shmring_open(swap ? &x->rx : &x->tx, f[0], f[1], f[2]) ||
+      shmring_open(swap ? &x->tx : &x->rx, f[3], f[4], f[5]))
+    OOPS("shmring_open()");
+}
+
+static void
+xserver(struct xport *x)
+{
+  char		buf[BUF];
+  uint64_t	total, got;
+  size_t	n;
+
+  for (;;)
+    {
+      xrecv(x, buf, MSG);
+      if (buf[0] == '!')
+        break;
+      xsend(x, buf, MSG);
+    }
+  xrecv(x, &total, sizeof total);
+  for (got=0; got<total; got+=n)
+    {
+      n	= total-got < sizeof buf ? total-got : sizeof buf;
+      xrecv(x, buf, n);
+    }
+  xsend(x, &total, sizeof total);
+}
+
+static int
+b_xserve(char **argv)
+{
+  struct xport	x;
+
+  xrings(&x, argv, 1);
+  xserver(&x);
+  return 0;
+}
+
+static int
+b_xfer(char **argv)
+{
+  struct xport	x;
+  const char	*label;
+  uint64_t	bytes, total, t, *lat;
+  char		buf[BUF];
+  double	secs;
+  pid_t		pid;
+  int		msgs, i, st, sp[2];
+
+  if (!argv[0] || !argv[1] || !argv[2])
+    OOPS("usage: xfer LABEL MB MSGS [FD1..FD6 -- cmd args..]");
+  label	= argv[0];
+  bytes	= (uint64_t)num(argv[1]) << 20;
+  msgs	= num(argv[2]);
+  lat	= malloc((msgs+1) * sizeof *lat);
+  if (!lat)
+    OOPS("out of memory");
+
+  if (argv[3])
+    {
+      xrings(&x, argv+3, 0);
+      argv	= cmd(argv+9);
+      pid	= fork();
+      if (pid == (pid_t)-1)
+        OOPS("fork()");
+      if (!pid)
+        {
+          execvp(argv[0], argv);
+          OOPS("exec %s", argv[0]);
+        }
+    }
+  else
+    {
+      if (socketpair(AF_UNIX, SOCK_STREAM, 0, sp))
+        OOPS("socketpair()");
+      pid	= fork();
+      if (pid == (pid_t)-1)
+        OOPS("fork()");
+      if (!pid)
+        {
+          close(sp[0]);
+          x.fd	= sp[1];
+          xserver(&x);
+          _exit(0);
+        }
+      close(sp[1]);
+      x.fd	= sp[0];
+    }
+
+  memset(buf, 'x', MSG);
+  for (i=0; i<msgs; i++)
+    {
+      t		= now();
+      xsend(&x, buf, MSG);
+      xrecv(&x, buf, MSG);
+      lat[i]	= now() - t;
+    }
+  buf[0]	= '!';
+  xsend(&x, buf, MSG);
+
+  memset(buf, 'y', sizeof buf);
+  t	= now();
+  xsend(&x, &bytes, sizeof bytes);
+  for (total=0; total<bytes; total+=sizeof buf)
+    xsend(&x, buf, sizeof buf);
+  xrecv(&x, &total, sizeof total);
+  secs	= (now() - t) / 1e9;
+
+  while (waitpid(pid, &st, 0) == (pid_t)-1)
+    if (errno != EINTR)
+      OOPS("waitpid()");
+  if (st || total != bytes)
+    {
+      errno	= 0;
+      OOPS("%s: server failed with status %d, got %llu of %llu bytes", label, st, (unsigned long long)total, (unsigned long long)bytes);
+    }
+
+  qsort(lat, msgs, sizeof *lat, u64cmp);
+  printf("{\"bench\":\"%s\",\"msgs\":%d,\"lat_p50_us\":%.1f,\"lat_p99_us\":%.1f,\"mb\":%llu,\"mb_per_s\":%.1f}\n"
+        , label, msgs, msgs ? pct(lat, msgs, 50) : 0, msgs ? pct(lat, msgs, 99) : 0
+        , (unsigned long long)(total >> 20), total / 1e6 / secs);
+  free(lat);
+  return 0;
+}
+
+/***********************************************************************
+ * FD intake: recvpool.h
+ **********************************************************************/
+
+static _Atomic int	intake_n, intake_w;
+static int		intake_max, intake_done[2];
+static uint64_t		intake_t0;
+
+static void
+intake(void *user, int worker, int fd)
+{
+  int	n;
+
+  close(fd);
+  n	= atomic_fetch_add(&intake_n, 1) + 1;
+  if (n == 1)
+    intake_t0	= now();
+  if (n == intake_max && write(intake_done[1], "", 1) != 1)
+    OOPS("write()");
+}
+
+/* intake get: own threads call recvpool_get() (fn==NULL)	*/
+static void *
+intake_get(void *arg)
+{
+  struct recvpool	*rp = arg;
+  int			w, fd;
+
+  w	= atomic_fetch_add(&intake_w, 1);
+  while ((fd = recvpool_get(rp, w, 1)) >= 0)
+    intake(NULL, w, fd);
+  return 0;
+}
+
+static int
+b_intake(char **argv)
+{
+  struct recvpool	*rp;
+  const char		*label;
+  unsigned long		stolen;
+  pthread_t		*th;
+  uint64_t		t;
+  char			c;
+  int			w, i, get;
+
+  if (!argv[0] || !argv[1] || !argv[2] || !argv[3])
+    OOPS("usage: intake LABEL SOCK WORKERS N [get]");
+  label		= argv[0];
+  w		= num(argv[2]);
+  intake_max	= num(argv[3]);
+  get		= argv[4] && !strcmp(argv[4], "get");
+  if (pipe(intake_done))
+    OOPS("pipe()");
+
+  rp	= recvpool_new(w, 0, get ? NULL : intake, NULL);
+  if (!rp || recvpool_add(rp, listener(argv[1])) || recvpool_start(rp))
+    OOPS("recvpool");
+  th	= calloc(w, sizeof *th);
+  if (!th)
+    OOPS("calloc()");
+  for (i=0; get && i<w; i++)
+    if ((errno = pthread_create(&th[i], NULL, intake_get, rp)) != 0)
+      OOPS("pthread_create()");
+  while (read(intake_done[0], &c, 1) != 1)
+    if (errno != EINTR)
+      OOPS("read()");
+  t	= now() - intake_t0;
+
+  stolen	= 0;
+  printf("{\"bench\":\"%s\",\"n\":%d,\"workers\":%d,\"fds_per_s\":%.0f,\"messages\":%lu,\"taken\":["
+        , label, intake_max, w, t ? intake_max * 1e9 / t : 0., rp->messages);
+  for (i=0; i<w; i++)
+    {
+      printf("%s%lu", i ? "," : "", rp->q[i].taken + rp->q[i].stolen);
+      stolen	+= rp->q[i].stolen;
+    }
+  printf("],\"stolen\":%lu}\n", stolen);
+  recvpool_stop(rp);
+  for (i=0; get && i<w; i++)
+    pthread_join(th[i], NULL);
+  recvpool_free(rp);
+  free(th);
+  return 0;
+}
+
+int
+main(int argc, char **argv)
+{
+  arg0	= argv[0];
+  if (argc<2)
+    OOPS("usage: run|sysc|pair|start|listen|sink|relay|client|xfer|xserve|intake args..");
+
+  if (!strcmp(argv[1], "run"))	return b_run(argv+2);
+  if (!strcmp(argv[1], "sysc"))	return b_sysc(argv+2);
+  if (!strcmp(argv[1], "pair"))	return b_pair(argv+2);
+  if (!strcmp(argv[1], "start"))	return b_start(argv+2);
+  if (!strcmp(argv[1], "listen"))	return b_listen(argv+2);
+  if (!strcmp(argv[1], "sink"))	return b_sink(argv+2);
+  if (!strcmp(argv[1], "relay"))	return b_relay(argv+2);
+  if (!strcmp(argv[1], "client"))	return b_client(argv+2);
+  if (!strcmp(argv[1], "xfer"))	return b_xfer(argv+2);
+  if (!strcmp(argv[1], "xserve"))	return b_xserve(argv+2);
+  if (!strcmp(argv[1], "intake"))	return b_intake(argv+2);
+  errno	= 0;
+  OOPS("unknown subcommand: %s", argv[1]);
+  return 23;
+}
@@ -9,7 +9,11 @@
  *	CPU	MEM	CALLS	<- worst
  * a)	N	N		create an index array (0..n-1)
  * b)	N log N	N+N/2+1	N log N	cmp over the index array
- * c)	2N	N	N	swaps according to the index array
+ * c)	2N	2N	N	swaps according to the index array
+ *
+ * For c) pos[] tracks where each original element is now, and at[]
+ * which original element is at a position.  Both are freed before
+ * returning, so the peak is 3N ints (index array, pos[], at[]).
  *
  * Overall:
  *
@@ -53,9 +57,9 @@ _mergesort(struct _mergesort *_, int *a, int n)
   _mergesort(_, r, n);
 
   i=j=k=0;
-  while (i<m && j<n)	a[k++] = _->cmp(_->user, l[i], r[j]) < 0 ? l[i++] : r[j++];
+  while (i<m && j<n)	a[k++] = _->cmp(_->user, l[i], r[j]) <= 0 ? l[i++] : r[j++];	/* stable	*/
   while (i<m)		a[k++] = l[i++];
-  while (j<n)		a[k++] = l[j++];
+  while (j<n)		a[k++] = r[j++];
 
   _->free(_->user, l);
   _->free(_->user, r);
@@ -70,7 +74,7 @@ mergesort(MERGESORT_USER_TYPE user
         , void (*free  )(MERGESORT_USER_TYPE, void *))
 {
   struct _mergesort	m;
-  int			*a, i;
+  int			*a, *pos, *at, i;
 
   if (n<2)
     return user;
@@ -85,20 +89,27 @@ mergesort(MERGESORT_USER_TYPE user
 
   _mergesort(&m, a, n);
 
-  /* a is the list of indexes into the original array.
+  /* a is the list of indexes into the original array:
+   * position i gets the element which originally was at a[i].
+   * pos[] is where an original element is now, at[] the reverse.
    */
-  for (i=0; i<n; )
+  pos	= alloc(user, n * sizeof *pos);
+  at	= alloc(user, n * sizeof *at);
+  for (i=n; --i>=0; pos[i] = at[i] = i);
+  for (i=0; i<n; i++)
     {
-      int	j = a[i];
+      int	j = pos[a[i]];
+
       if (i == j)
-        {
-          i++;
-          continue;
-        }
+        continue;
       swap(user, i, j);
-      a[i]	= a[j];
-      a[j]	= j;	/* one position now ok	*/
+      pos[at[i]]	= j;
+      at[j]		= at[i];
+      at[i]		= a[i];
+      pos[a[i]]		= i;
     }
+  free(user, at);
+  free(user, pos);
 
   free(user, a);
   return user;
@@ -8,6 +8,9 @@
 #include "passfd.h"
 
 /* This also is an example how to use passfd.h
+ *
+ * Optional, for USDT probes:
+ #debian systemtap-sdt-dev
  */
 
 int
@@ -18,22 +18,53 @@
 #include <fcntl.h>
 #include <stdint.h>
 #include <poll.h>
+#include <limits.h>
 
 #include <sys/stat.h>
 #include <sys/socket.h>
 #include <sys/types.h>
 #include <sys/un.h>
 #include <sys/wait.h>
+#include <dirent.h>
+#include <sys/mman.h>
+
+#ifdef	__linux__
+#include <sys/sendfile.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+#include <sched.h>
+#include <sys/syscall.h>
+#include <linux/netlink.h>
+#include <linux/genetlink.h>
+#ifdef	__has_include
+#if	__has_include(<linux/mptcp.h>)
+#include <linux/mptcp.h>
+#endif
+#endif
+#endif
 
 #include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <netinet/udp.h>
+#include <arpa/inet.h>
+#include <signal.h>
 
 #ifndef	PASSFD_VERSION
 #define	PASSFD_VERSION	"-undef"
 #endif
 
+#ifdef	MSG_NOSIGNAL
+#define	PFD_MSG_NOSIGNAL	MSG_NOSIGNAL
+#else
+#define	PFD_MSG_NOSIGNAL	0
+#endif
+
 struct PFD_passfd;
 #define	MERGESORT_USER_TYPE	struct PFD_passfd *
 #include "mergesort.h"
+#include "pfdwire.h"
+#include "shmring.h"
 
 
 /***********************************************************************
@@ -42,6 +73,32 @@ struct PFD_passfd;
 
 #define	P(X,Y,...)	static Y PFD_##X(struct PFD_passfd *_, ##__VA_ARGS__)
 
+struct PFD_trace;
+struct PFD_backend;
+
+enum PFD_phase
+  {
+    PFD_PH_RESOLVE,
+    PFD_PH_CONNECT,
+    PFD_PH_RETRY_SLEEP,
+    PFD_PH_ACCEPT_WAIT,
+    PFD_PH_SEND,
+    PFD_PH_RECV,
+    PFD_PH_CHILD,
+    PFD_PH_MAX
+  };
+
+struct PFD_metrics
+  {
+    int			fd;		/* -1 if metrics are off	*/
+    struct sockaddr_un	addr;		/* for datagram sockets	*/
+    socklen_t		addrlen;	/* 0 if fd is no datagram socket	*/
+    uint64_t		start;
+    uint64_t		ns[PFD_PH_MAX];	/* time spent in phases	*/
+    unsigned		connects, connect_fails, accepts, retries, sleeps, fds_sent, fds_recv, forks;
+    unsigned		batches_sent, batches_recv;	/* messages	*/
+  };
+
 struct PFD_passfd
   {
     int			code;		/* exit code	*/
@@ -52,19 +109,38 @@ struct PFD_passfd
 
     unsigned		done:1;
 
-    unsigned		listen:1, accept:1, connect:1, onsuccess:1, onerror:1, dofork:1, keepfds:1, verbose:1;
+    unsigned		listen:1, accept:1, connect:1, onsuccess:1, onerror:1, dofork:1, keepfds:1, verbose:1, gamble:1;
+    unsigned		supervised:1;	/* command handed to PASSFD_SUPERVISOR	*/
+    unsigned		speculate:1;	/* f f: start command before connect	*/
+    unsigned		relay:1;	/* k p: persistent relay, see PFD_relay()	*/
+    unsigned		quiet:1;	/* q: do not set PASSFD_ environment	*/
+    unsigned		mptcp:1;	/* m: TCP sockets are MPTCP, see PFD_socket()	*/
     unsigned char	mode;
 
     int			retry;
     int			timeout;
 
     const char		*sockname;
+    const char		*nonce;		/* n: PASSFD_NONCE, NULL if not used	*/
+    const char		*dest;		/* mode b	*/
+    int			count;		/* mode b: connections to keep, j: operations in parallel	*/
     int			*fds, *waits, *uses, *recfds;
+    int			*kept;		/* FDs kept by FD factories (@keep)	*/
+    struct pfdwire_fd	*fdmeta, *recmeta;	/* names of fds and recfds, NULL if none	*/
     char * const	*cmd;
     int			ret;
 
     int			afake;
     struct addrinfo	*as, *a;
+
+    uint64_t		connect_ns;	/* of last connect_sock(), 0 if failed	*/
+    pid_t		spec_pid;	/* f f: the command waiting on spec	*/
+    int			spec;
+    struct PFD_backend	*backend;	/* see open_tcp()	*/
+    int			netns, netns0;	/* PASSFD_NETNS and our own, -1 if unused	*/
+
+    struct PFD_trace	*trace;		/* NULL if tracing is off	*/
+    struct PFD_metrics	metrics;
   };
 
 
@@ -77,11 +153,29 @@ struct PFD_passfd
 #define	PFD_FATAL(X,...)	do { if (X) PFD_OOPS(_, "fatal error in %s:%d:%s: " #X, __FILE__, __LINE__, __func__, ##__VA_ARGS__); } while (0)
 
 P(exec, void, int, int);
+P(speculate, void);
+P(main, void);
+P(netns_init, void);
+P(socket, int, int domain, int type);
+P(supervise, int, pid_t pid);
+P(sendfd_try, int, int sock, int *list, struct pfdwire_fd *meta, int flags);
+P(cloexec, void, int fd, int keep);
+P(poll, void, int fd, int flag);
+P(nonblock, void, int fd);
+P(trace_flush, void);
+P(metrics_emit, void, const char *why);
+P(int, int, const char *);
+P(vappend, void, char *buf, size_t max, const char *s, va_list list);
+P(append, void, char *buf, size_t max, const char *s, ...);
+P(readfile, ssize_t, const char *name, char *buf, size_t max);
 
 /* Terminate impl.
  */
 P(vOOPS, void, int e, const char *s, va_list list)
 {
+  PFD_trace_flush(_);
+  PFD_metrics_emit(_, "error");
+  _->metrics.fd	= -1;	/* only one record	*/
   fprintf(stderr, "OOPS: ");
   vfprintf(stderr, s, list);
   if (e)
@@ -104,25 +198,37 @@ P(OOPS, void, const char *s, ...)
 }
 
 /* PFD_V/E/R impl
+ *
+ * The line is formatted into a buffer and written with a single write(),
+ * the date part only is recalculated when the second changes.
  */
 P(vV, void, int e, const char *prefix, const char *s, va_list list)
 {
-  time_t	t;
-  struct tm	tm;
+  static time_t		last = -1;
+  static char		date[24];
+  struct timespec	ts;
+  char			buf[1024];
+  size_t		len;
 
   if (!_->verbose)
     return;
 
-  time(&t);
-  gmtime_r(&t, &tm);	/* always use UTC!	*/
-  fprintf(stderr, "%04d-%02d-%02d %02d:%02d:%02d [%d] ", 1900+tm.tm_year, tm.tm_mon+1, tm.tm_mday, tm.tm_hour, tm.tm_min, tm.tm_sec, (int)getpid());
-  if (prefix)
-    fprintf(stderr, "%s ", prefix);
-  vfprintf(stderr, s, list);
+  clock_gettime(CLOCK_REALTIME, &ts);
+  if (ts.tv_sec != last)
+    {
+      struct tm	tm;
+
+      last	= ts.tv_sec;
+      gmtime_r(&last, &tm);	/* always use UTC!	*/
+      strftime(date, sizeof date, "%Y-%m-%d %H:%M:%S", &tm);
+    }
+  snprintf(buf, sizeof buf, "%s.%06ld [%d] %s%s", date, (long)ts.tv_nsec/1000, (int)getpid(), prefix ? prefix : "", prefix ? " " : "");
+  PFD_vappend(_, buf, sizeof buf - 1, s, list);
   if (e)
-    fprintf(stderr, ": %s", strerror(errno));
-  fprintf(stderr, "\n");
-  fflush(stderr);
+    PFD_append(_, buf, sizeof buf - 1, ": %s", strerror(e));
+  len		= strlen(buf);
+  buf[len++]	= '\n';
+  while (write(2, buf, len)<0 && errno == EINTR);
 }
 
 /* PFD_V(_, ..) report verbose
@@ -168,6 +274,24 @@ P(R, int, int ret, const char *s, ...)
   return ret;
 }
 
+/* PFD_warn(_, ..) always report, with errno
+ */
+P(warn, void, const char *s, ...)
+{
+  int		e = errno;
+  va_list	list;
+
+  va_start(list, s);
+  fprintf(stderr, "WARN: ");
+  vfprintf(stderr, s, list);
+  if (e)
+    fprintf(stderr, ": %s", strerror(e));
+  fprintf(stderr, "\n");
+  va_end(list);
+
+  errno	= e;
+}
+
 
 /***********************************************************************
  * Memory Management
@@ -201,19 +325,16 @@ P(dup, char *, const char *s)
   return r;
 }
 
-P(append, void, char *buf, size_t max, const char *s, ...)
+P(vappend, void, char *buf, size_t max, const char *s, va_list list)
 {
   size_t	len;
 
   len	= strlen(buf);
   if (len<max)
     {
-      va_list	list;
       int	put;
 
-      va_start(list, s);
       put	= vsnprintf(buf+len, max-len, s, list);
-      va_end(list);
       if (put < max-len)
         return;
     }
@@ -227,6 +348,423 @@ P(append, void, char *buf, size_t max, const char *s, ...)
     buf[max-1] = 0;
 }
 
+P(append, void, char *buf, size_t max, const char *s, ...)
+{
+  va_list	list;
+
+  va_start(list, s);
+  PFD_vappend(_, buf, max, s, list);
+  va_end(list);
+}
+
+
+/***********************************************************************
+ * Tracing
+ *
+ * PASSFD_TRACE=[json:]FD|file enables tracing:
+ * Events are recorded with CLOCK_MONOTONIC into a preallocated ring
+ * and written out on exit, exec, error and signals (see PFD_signals()).
+ * Writing out only uses write(), as it can happen in a signal handler.
+ **********************************************************************/
+
+#define	PFD_TRACE_MAX	256	/* events kept until flush, older ones are lost	*/
+
+enum PFD_ev
+  {
+    PFD_EV_BIND,
+    PFD_EV_ACCEPT,
+    PFD_EV_CONNECT,
+    PFD_EV_SENDMSG,
+    PFD_EV_RECVMSG,
+    PFD_EV_DUP2,
+    PFD_EV_FORK,
+    PFD_EV_EXEC,
+    PFD_EV_EXIT,
+  };
+
+static const char * const PFD_evname[] =
+  {
+    "bind", "accept", "connect", "sendmsg", "recvmsg", "dup2", "fork", "exec", "exit",
+  };
+
+struct PFD_event
+  {
+    uint64_t		ns;
+    int			fd, arg, err;
+    enum PFD_ev		ev;
+  };
+
+struct PFD_trace
+  {
+    int			fd, json;
+    unsigned		count;		/* events since last flush	*/
+    struct PFD_event	ring[PFD_TRACE_MAX];
+  };
+
+/* PFD_T(_, EV, fd, arg): record event EV if tracing, errno is recorded, too
+ */
+#define	PFD_T(_,EV,FD,ARG)	do { if ((_)->trace) PFD_trace(_, PFD_EV_##EV, FD, ARG); } while (0)
+
+P(ns, uint64_t)
+{
+  struct timespec	ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+P(trace, void, enum PFD_ev ev, int fd, int arg)
+{
+  struct PFD_event	*e;
+
+  e		= &_->trace->ring[_->trace->count++ % PFD_TRACE_MAX];
+  e->ns		= PFD_ns(_);
+  e->ev		= ev;
+  e->fd		= fd;
+  e->arg	= arg;
+  e->err	= fd<0 ? errno : 0;
+}
+
+/* async signal safe formatting: append string	*/
+P(tcat, char *, char *p, const char *s)
+{
+  while (*s)
+    *p++	= *s++;
+  return p;
+}
+
+/* async signal safe formatting: append number	*/
+P(tnum, char *, char *p, long long n)
+{
+  char			tmp[24];
+  int			i;
+  unsigned long long	u;
+
+  u	= n;
+  if (n<0)
+    {
+      *p++	= '-';
+      u		= -u;
+    }
+  i	= 0;
+  do
+    tmp[i++]	= '0' + u % 10;
+  while (u /= 10);
+  while (i)
+    *p++	= tmp[--i];
+  return p;
+}
+
+P(trace_line, char *, char *p, int pid, const char *ev, const struct PFD_event *e)
+{
+  unsigned	div;
+
+  if (_->trace->json)
+    {
+      p	= PFD_tcat(_, p, "{\"ns\":");	p = PFD_tnum(_, p, e->ns);
+      p	= PFD_tcat(_, p, ",\"pid\":");	p = PFD_tnum(_, p, pid);
+      p	= PFD_tcat(_, p, ",\"ev\":\"");	p = PFD_tcat(_, p, ev);
+      p	= PFD_tcat(_, p, "\",\"fd\":");	p = PFD_tnum(_, p, e->fd);
+      p	= PFD_tcat(_, p, ",\"arg\":");	p = PFD_tnum(_, p, e->arg);
+      p	= PFD_tcat(_, p, ",\"err\":");	p = PFD_tnum(_, p, e->err);
+      return PFD_tcat(_, p, "}\n");
+    }
+  p	= PFD_tnum(_, p, e->ns / 1000000000);
+  *p++	= '.';
+  for (div=100000000; div; div/=10)
+    *p++	= '0' + e->ns % 1000000000 / div % 10;
+  p	= PFD_tcat(_, p, " [");		p = PFD_tnum(_, p, pid);
+  p	= PFD_tcat(_, p, "] ");		p = PFD_tcat(_, p, ev);
+  p	= PFD_tcat(_, p, " fd=");	p = PFD_tnum(_, p, e->fd);
+  p	= PFD_tcat(_, p, " arg=");	p = PFD_tnum(_, p, e->arg);
+  if (e->err)
+    {
+      p	= PFD_tcat(_, p, " err=");
+      p	= PFD_tnum(_, p, e->err);
+    }
+  return PFD_tcat(_, p, "\n");
+}
+
+P(trace_flush, void)
+{
+  struct PFD_trace	*t = _->trace;
+  char			buf[4096], *p;
+  unsigned		i, n;
+  int			pid, e;
+
+  if (!t || !t->count)
+    return;
+
+  e	= errno;
+  pid	= getpid();
+  p	= buf;
+  n	= t->count < PFD_TRACE_MAX ? t->count : PFD_TRACE_MAX;
+  if (n < t->count)
+    {
+      struct PFD_event	lost = { 0 };
+
+      lost.ns	= t->ring[t->count % PFD_TRACE_MAX].ns;
+      lost.fd	= -1;
+      lost.arg	= t->count - n;
+      p		= PFD_trace_line(_, p, pid, "lost", &lost);
+    }
+  for (i=t->count-n; i != t->count; i++)
+    {
+      struct PFD_event	*ev = &t->ring[i % PFD_TRACE_MAX];
+
+      p	= PFD_trace_line(_, p, pid, PFD_evname[ev->ev], ev);
+      if (p > buf + sizeof buf - 200)
+        {
+          while (write(t->fd, buf, p-buf)<0 && errno == EINTR);
+          p	= buf;
+        }
+    }
+  if (p != buf)
+    while (write(t->fd, buf, p-buf)<0 && errno == EINTR);
+  t->count	= 0;
+  errno		= e;
+}
+
+P(trace_init, void)
+{
+  struct PFD_trace	*t;
+  const char		*s;
+  int			i;
+
+  s	= getenv("PASSFD_TRACE");
+  if (!s || !*s)
+    return;
+
+  t		= PFD_alloc(_, sizeof *t);
+  t->count	= 0;
+  t->json	= !strncmp(s, "json:", 5);
+  if (t->json)
+    s	+= 5;
+  for (i=0; isdigit(s[i]); i++);
+  if (i && !s[i])
+    t->fd	= PFD_int(_, s);
+  else if ((t->fd = open(s, O_WRONLY|O_CREAT|O_APPEND|O_CLOEXEC, 0600))<0)
+    PFD_OOPS(_, "cannot open trace file: %s", s);
+
+  _->trace	= t;
+}
+
+
+/* USDT probes: static tracepoints for bpftrace/perf/systemtap
+ *
+ * Compiled in when <sys/sdt.h> is available (or PASSFD_SDT=1),
+ * PASSFD_SDT=0 disables them.  A probe is a single NOP when unattached,
+ * and the timing arguments are only taken while a tracer is attached
+ * (the tracer sets the probe's semaphore).
+ *
+ * provider "passfd", probes and arguments:
+ *	accept		listen_fd, fd, sockname, wait_ns
+ *	connect		fd, sockname, fail, ns
+ *	sendfd		sock, fd_count, ns
+ *	recvfd		sock, fd_count, ns
+ *	map		fd_count, ns
+ *	exec		cmd, dofork, pid
+ *	retry		count, sleep_ms, total_ms
+ */
+
+#ifndef	PASSFD_SDT
+#if defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#define	PASSFD_SDT	1
+#endif
+#endif
+#endif
+
+#if PASSFD_SDT
+#define	_SDT_HAS_SEMAPHORES	1
+#include <sys/sdt.h>
+
+#define	PFD_SEMA(N)	__extension__ unsigned short passfd_##N##_semaphore __attribute__((unused)) __attribute__((section(".probes")))
+PFD_SEMA(accept);
+PFD_SEMA(connect);
+PFD_SEMA(sendfd);
+PFD_SEMA(recvfd);
+PFD_SEMA(map);
+PFD_SEMA(exec);
+PFD_SEMA(retry);
+#undef	PFD_SEMA
+
+#define	PFD_PROBING(N)		__builtin_expect(passfd_##N##_semaphore, 0)
+#define	PFD_PROBE(N,...)	STAP_PROBEV(passfd, N, ##__VA_ARGS__)
+#else
+static void PFD_noprobe(int n, ...) { }	/* only there to use the arguments	*/
+#define	PFD_PROBING(N)		0
+#define	PFD_PROBE(N,...)	do { if (0) PFD_noprobe(0, ##__VA_ARGS__); } while (0)
+#endif
+
+/* start time for a probe's duration, 0 if not attached	*/
+#define	PFD_PROBE_T0(N)		(PFD_PROBING(N) ? PFD_ns(_) : 0)
+/* duration since PFD_PROBE_T0()	*/
+#define	PFD_PROBE_NS(T0)	((T0) ? PFD_ns(_) - (T0) : 0)
+
+
+/***********************************************************************
+ * Metrics
+ *
+ * PASSFD_METRICS=FD|file|unix:path|@abstract enables a per invocation
+ * record of counters and phase durations.  It is written as one JSON line
+ * on exit, before exec, on error and SIGUSR1.  unix: and @ send it as a
+ * single datagram.  Like tracing this only uses write()/sendto().
+ **********************************************************************/
+
+/* PFD_M0(_): start of a phase, 0 if metrics are off
+ * PFD_M(_, PHASE, t0): add the time since t0 to phase
+ * PFD_MC(_, COUNTER, n): add n to counter
+ */
+#define	PFD_M0(_)		((_)->metrics.fd>=0 ? PFD_ns(_) : 0)
+#define	PFD_M(_,PHASE,T0)	do { if (T0) (_)->metrics.ns[PFD_PH_##PHASE] += PFD_ns(_) - (T0); } while (0)
+#define	PFD_MC(_,COUNTER,N)	((_)->metrics.COUNTER += (N))
+
+static const char * const PFD_phname[PFD_PH_MAX] =
+  {
+    "resolve", "connect", "retry_sleep", "accept_wait", "send", "recv", "child",
+  };
+
+static struct PFD_passfd	*PFD_signaled;	/* for the signal handler	*/
+
+/* Write the record, why is exit, exec, error or signal
+ */
+P(metrics_emit, void, const char *why)
+{
+  struct PFD_metrics	*m = &_->metrics;
+  char			buf[1024], *p;
+  char			mode[2];
+  int			i, e;
+
+  if (m->fd<0)
+    return;
+
+  e		= errno;
+  mode[0]	= _->mode ? _->mode : '-';
+  mode[1]	= 0;
+  p	= buf;
+  p	= PFD_tcat(_, p, "{\"pid\":");		p = PFD_tnum(_, p, getpid());
+  p	= PFD_tcat(_, p, ",\"why\":\"");	p = PFD_tcat(_, p, why);
+  p	= PFD_tcat(_, p, "\",\"mode\":\"");	p = PFD_tcat(_, p, mode);
+  p	= PFD_tcat(_, p, "\",\"code\":");	p = PFD_tnum(_, p, _->code);
+  p	= PFD_tcat(_, p, ",\"ret\":");		p = PFD_tnum(_, p, _->ret);
+  p	= PFD_tcat(_, p, ",\"total_ns\":");	p = PFD_tnum(_, p, PFD_ns(_) - m->start);
+  for (i=0; i<PFD_PH_MAX; i++)
+    {
+      p	= PFD_tcat(_, p, ",\"");
+      p	= PFD_tcat(_, p, PFD_phname[i]);
+      p	= PFD_tcat(_, p, "_ns\":");
+      p	= PFD_tnum(_, p, m->ns[i]);
+    }
+  p	= PFD_tcat(_, p, ",\"connects\":");	p = PFD_tnum(_, p, m->connects);
+  p	= PFD_tcat(_, p, ",\"connect_fails\":");	p = PFD_tnum(_, p, m->connect_fails);
+  p	= PFD_tcat(_, p, ",\"accepts\":");	p = PFD_tnum(_, p, m->accepts);
+  p	= PFD_tcat(_, p, ",\"retries\":");	p = PFD_tnum(_, p, m->retries);
+  p	= PFD_tcat(_, p, ",\"sleeps\":");	p = PFD_tnum(_, p, m->sleeps);
+  p	= PFD_tcat(_, p, ",\"fds_sent\":");	p = PFD_tnum(_, p, m->fds_sent);
+  p	= PFD_tcat(_, p, ",\"fds_recv\":");	p = PFD_tnum(_, p, m->fds_recv);
+  p	= PFD_tcat(_, p, ",\"batches_sent\":");	p = PFD_tnum(_, p, m->batches_sent);
+  p	= PFD_tcat(_, p, ",\"batches_recv\":");	p = PFD_tnum(_, p, m->batches_recv);
+  p	= PFD_tcat(_, p, ",\"forks\":");	p = PFD_tnum(_, p, m->forks);
+  p	= PFD_tcat(_, p, "}\n");
+
+  if (m->addrlen)
+    sendto(m->fd, buf, p-buf, MSG_DONTWAIT, (struct sockaddr *)&m->addr, m->addrlen);
+  else
+    while (write(m->fd, buf, p-buf)<0 && errno == EINTR);
+  errno	= e;
+}
+
+static void
+PFD_sig(int sig)
+{
+  PFD_trace_flush(PFD_signaled);
+  PFD_metrics_emit(PFD_signaled, "signal");
+  if (sig == SIGUSR1)
+    return;
+  signal(sig, SIG_DFL);
+  raise(sig);
+}
+
+/* After fork() the child only accounts for what it does itself
+ */
+P(metrics_forked, void)
+{
+  memset(_->metrics.ns, 0, sizeof _->metrics.ns);
+  _->metrics.connects	= 0;
+  _->metrics.connect_fails= 0;
+  _->metrics.accepts	= 0;
+  _->metrics.retries	= 0;
+  _->metrics.sleeps	= 0;
+  _->metrics.fds_sent	= 0;
+  _->metrics.fds_recv	= 0;
+  _->metrics.batches_sent	= 0;
+  _->metrics.batches_recv	= 0;
+  _->metrics.forks	= 0;
+}
+
+P(metrics_init, void)
+{
+  struct PFD_metrics	*m = &_->metrics;
+  const char		*s;
+  int			i;
+
+  m->fd	= -1;
+  s	= getenv("PASSFD_METRICS");
+  if (!s || !*s)
+    return;
+
+  m->start	= PFD_ns(_);
+  for (i=0; isdigit(s[i]); i++);
+  if (i && !s[i])
+    {
+      m->fd	= PFD_int(_, s);
+      return;
+    }
+  if (*s != '@' && strncmp(s, "unix:", 5))
+    {
+      if ((m->fd = open(s, O_WRONLY|O_CREAT|O_APPEND|O_CLOEXEC, 0600))<0)
+        PFD_OOPS(_, "cannot open metrics file: %s", s);
+      return;
+    }
+
+  if (*s != '@')
+    s	+= 5;
+  if (strlen(s) >= sizeof m->addr.sun_path)
+    PFD_OOPS(_, "metrics socket name too long: %s", s);
+  m->addr.sun_family	= AF_UNIX;
+  strcpy(m->addr.sun_path, s);
+  if (*s == '@')
+    m->addr.sun_path[0]	= 0;	/* Abstract Linux Socket	*/
+  m->addrlen	= offsetof(struct sockaddr_un, sun_path) + strlen(s);
+  if ((m->fd = socket(AF_UNIX, SOCK_DGRAM, 0))<0 || fcntl(m->fd, F_SETFD, FD_CLOEXEC))
+    PFD_OOPS(_, "cannot create metrics socket");
+}
+
+/* SIGUSR1 writes trace and metrics, HUP/INT/TERM do so and terminate
+ */
+P(signals, void)
+{
+  static const int	sigs[] = { SIGUSR1, SIGHUP, SIGINT, SIGTERM };
+  int			i;
+
+  if (!_->trace && _->metrics.fd<0)
+    return;
+
+  PFD_signaled	= _;
+  for (i=0; i<(int)(sizeof sigs / sizeof *sigs); i++)
+    {
+      struct sigaction	sa;
+
+      if (sigaction(sigs[i], NULL, &sa) || sa.sa_handler == SIG_IGN)
+        continue;
+      memset(&sa, 0, sizeof sa);
+      sa.sa_handler	= PFD_sig;
+      sa.sa_flags	= SA_RESTART;
+      sigaction(sigs[i], &sa, NULL);
+    }
+}
+
 
 /***********************************************************************
  * Argument splitting
@@ -238,6 +776,10 @@ P(init, void, const char *arg0)
   memset(_, 0, sizeof *_);
   _->arg0	= arg0;
   _->sock	= -1;
+  PFD_netns_init(_);
+  PFD_trace_init(_);
+  PFD_metrics_init(_);
+  PFD_signals(_);
 }
 
 /* Deallocate structure and return return code
@@ -248,6 +790,9 @@ P(exit, int)
 {
   /* XXX TODO XXX free everything	*/
   PFD_V(_, "return code %d", _->code);
+  PFD_T(_, EXIT, -1, _->code);
+  PFD_trace_flush(_);
+  PFD_metrics_emit(_, "exit");
   return _->code;
 }
 
@@ -321,49 +866,86 @@ struct PFD_split
     const char	**argv;
   };
 
-P(split_add, void, struct PFD_split *p, const char *s)
-{
-  p->argv		= PFD_realloc(_, p->argv, (++p->argc)*sizeof *p->argv);
-  p->argv[++p->argc]	= s ? PFD_dup(_, s) : s;
-}
-
-P(split_free, void, struct PFD_split *p)
-{
-  while (p->argc--)
-    PFD_free(_, (void *)p->argv[p->argc]);
-  PFD_free(_, p->argv);
-  p->argv	= 0;
-}
-
-P(split_split, void, struct PFD_split *p, const char *s)
-{
-  char	*r = PFD_dup(_, s), *x = 0, *tmp;
-
-  for (tmp=strtok_r(r, " ", &x); tmp; tmp=strtok_r(NULL, " ", &x))
-    PFD_split_add(_, p, tmp);
-  PFD_free(_, r);
-}
-
+/* One allocation: the struct, argv[] (NULL terminated) and the words
+ */
 P(split, struct PFD_split *, const char *s)
 {
   struct PFD_split	*p;
+  size_t		len, max;
+  char			*buf, *x, *tmp;
 
-  p		= PFD_alloc(_, sizeof *p);
+  if (!s)
+    s	= "";
+  len		= strlen(s)+1;
+  max		= len/2 + 1;	/* words are separated, plus NULL	*/
+  p		= PFD_alloc(_, sizeof *p + max * sizeof *p->argv + len);
+  p->argv	= (const char **)(p+1);
+  buf		= (char *)(p->argv + max);
+  memcpy(buf, s, len);
   p->argc	= 0;
-  p->argv	= 0;
-  if (s)
-    PFD_split_split(_, p, s);
+  for (tmp=strtok_r(buf, " ", &x); tmp; tmp=strtok_r(NULL, " ", &x))
+    p->argv[p->argc++]	= tmp;
+  p->argv[p->argc]	= 0;
   return p;
 }
 
+P(split_free, void, struct PFD_split *p)
+{
+  PFD_free(_, p);
+}
+
 
 /***********************************************************************
  * Integer list
  * i[0]	number of integers
  * i[1] first integer
  * i[i[0]] last integer
+ *
+ * Lists which grow are allocated in powers of 2 (see PFD_ints_room()),
+ * so appending is linear.  Lists of known size are allocated exactly.
  **********************************************************************/
 
+#define	PFD_INTS_MIN	8
+#define	PFD_RANGE_MAX	(1<<24)	/* FDs in a range	*/
+
+/* Make room for n more integers, returns where they go
+ *
+ * Integer lists keep the count in [0].  The capacity is not stored,
+ * it is the power of 2 (at least PFD_INTS_MIN) above the count,
+ * so all integer lists must be allocated here.
+ */
+P(ints_room, int *, int **i, int n)
+{
+  int	have, need;
+
+  if (!*i)
+    {
+      *i	= PFD_alloc(_, PFD_INTS_MIN * sizeof **i);
+      **i	= 0;
+    }
+  for (have=PFD_INTS_MIN; have < 1 + **i; have *= 2);
+  need	= 1 + **i + n;
+  if (need > have)
+    {
+      while (have < need)
+        have	*= 2;
+      *i	= PFD_realloc(_, *i, have * sizeof **i);
+    }
+  return *i + 1 + **i;
+}
+
+P(ints_add, void, int **i, int v)
+{
+  *PFD_ints_room(_, i, 1)	= v;
+  ++**i;
+}
+
+static int
+PFD_qcmp(const void *a, const void *b)
+{
+  return *(const int *)a - *(const int *)b;
+}
+
 P(intlist, char *, char *buf, size_t len, int *ints, int n)
 {
   int	i;
@@ -383,11 +965,67 @@ P(int, int, const char *s)
 
   u	= strtoll(s, &end, 10);
   i	= u;
-  if (i<-1 || (unsigned long long)i != u || !end || *end)
+  if (!*s || i<-1 || (unsigned long long)i != u || !end || *end)
     PFD_OOPS(_, "number overflow: %s", s);
   return i;
 }
 
+/* A-B[/S]: from A to B (including) in steps of S
+ */
+P(range, void, int **i, const char *s)
+{
+  char	*tmp, *to, *step;
+  int	a, b, d, n, k, *p;
+
+  tmp	= PFD_dup(_, s);
+  to	= strchr(tmp, '-');
+  *to++	= 0;
+  step	= strchr(to, '/');
+  if (step)
+    *step++	= 0;
+  if (!*tmp || !*to || (step && !*step))
+    PFD_OOPS(_, "invalid FD range: %s", s);
+  a	= PFD_int(_, tmp);
+  b	= PFD_int(_, to);
+  d	= step ? PFD_int(_, step) : 1;
+  if (d<1 || b<a)
+    PFD_OOPS(_, "invalid FD range: %s", s);
+  n	= (b-a)/d + 1;
+  if (n > PFD_RANGE_MAX)
+    PFD_OOPS(_, "FD range too large: %s", s);
+  PFD_free(_, tmp);
+
+  p	= PFD_ints_room(_, i, n);
+  for (k=0; k<n; k++)
+    p[k]	= a + k*d;
+  **i	+= n;
+}
+
+/* all-open: all FDs which are inherited (no close-on-exec), sorted
+ */
+P(allopen, void, int **i)
+{
+  DIR		*d;
+  struct dirent	*e;
+  int		n0, fd;
+
+  d	= opendir("/dev/fd");
+  if (!d)
+    PFD_OOPS(_, "cannot list open FDs: /dev/fd");
+  n0	= *i ? **i : 0;
+  while ((e = readdir(d))!=0)
+    {
+      if (!isdigit(e->d_name[0]))
+        continue;
+      fd	= PFD_int(_, e->d_name);
+      if (fd == dirfd(d) || (fcntl(fd, F_GETFD) & FD_CLOEXEC))
+        continue;
+      PFD_ints_add(_, i, fd);
+    }
+  closedir(d);
+  qsort(*i + 1 + n0, **i - n0, sizeof **i, PFD_qcmp);
+}
+
 P(getint, int, int **i, const char *s)
 {
   if (!s)
@@ -408,21 +1046,24 @@ P(getint, int, int **i, const char *s)
       return 0;
     }
 
+  if (!strcmp(s, "all-open"))
+    {
+      PFD_allopen(_, i);
+      return 0;
+    }
   if (!isdigit(*s) && strcmp(s, "-1"))	/* -1 is of special value	*/
     return 1;
 
-  *i		= PFD_realloc(_, *i, (1 + ++(**i)) * sizeof **i);
-  i[0][**i]	= PFD_int(_, s);
+  if (strchr(s+1, '-'))	/* not the one of -1	*/
+    PFD_range(_, i, s);
+  else
+    PFD_ints_add(_, i, PFD_int(_, s));
   return 0;
 }
 
 P(getints, char * const *, char * const * argv, int **i)
 {
-  if (!*i)
-    {
-      *i	= PFD_alloc(_, sizeof **i);
-      **i	= 0;
-    }
+  PFD_ints_room(_, i, 0);
   for (;; argv++)
     if (PFD_getint(_, i, *argv))
       return argv;
@@ -450,26 +1091,740 @@ P(ints, int, int *list, int **ret)
 
 
 /***********************************************************************
- * File helpers
+ * Name resolution
+ *
+ * A static build should define PASSFD_NUMERIC: getaddrinfo() would load
+ * NSS of the glibc it was linked with at runtime, so only numeric
+ * addresses and ports are understood there.  Names fail with OOPS.
  **********************************************************************/
 
-P(close, void, int sock, const char *name)
+P(getaddrinfo, int, const char *host, const char *port, const struct addrinfo *hints, struct addrinfo **res)
 {
-  for (;;)
+#ifndef	PASSFD_NUMERIC
+  return getaddrinfo(host, port, hints, res);
+#else
+  struct
     {
-      if (!close(sock))
-        {
-          PFD_V(_, "close %d: %s", sock, name);
-          if (sock == _->sock)
-            _->sock	= -1;
-          return;
-        }
-      if (errno != EINTR)
-        PFD_OOPS(_, "close %d fail: %s", sock, name);
-      PFD_V(_, "close %d interrupted: %s", sock, name);
+      struct addrinfo		ai;	/* first, so PFD_free() works	*/
+      struct sockaddr_storage	sa;
+    }			*r;
+  struct sockaddr_in	*in;
+  struct sockaddr_in6	*in6;
+  struct addrinfo	h;
+  char			*end;
+  long			n;
+
+  memset(&h, 0, sizeof h);
+  if (hints)
+    h	= *hints;
+  n	= port ? strtol(port, &end, 10) : 0;
+  if (port && (!*port || *end || n<0 || n>65535))
+    return EAI_SERVICE;
+
+  r	= PFD_alloc(_, sizeof *r);
+  memset(r, 0, sizeof *r);
+  in	= (struct sockaddr_in *)&r->sa;
+  in6	= (struct sockaddr_in6 *)&r->sa;
+  if (!host && h.ai_family != AF_INET6)
+    {
+      in->sin_family		= AF_INET;
+      in->sin_addr.s_addr	= htonl(h.ai_flags & AI_PASSIVE ? INADDR_ANY : INADDR_LOOPBACK);
     }
-}
-
+  else if (!host)
+    {
+      in6->sin6_family		= AF_INET6;
+      in6->sin6_addr		= h.ai_flags & AI_PASSIVE ? in6addr_any : in6addr_loopback;
+    }
+  else if (h.ai_family != AF_INET6 && inet_pton(AF_INET, host, &in->sin_addr) == 1)
+    in->sin_family		= AF_INET;
+  else if (h.ai_family != AF_INET && inet_pton(AF_INET6, host, &in6->sin6_addr) == 1)
+    in6->sin6_family		= AF_INET6;
+  else
+    PFD_OOPS(_, "%s: numeric hosts only (built with PASSFD_NUMERIC)", host);
+
+  r->ai.ai_family	= r->sa.ss_family;
+  r->ai.ai_socktype	= h.ai_socktype ? h.ai_socktype : SOCK_STREAM;
+  r->ai.ai_addr		= (struct sockaddr *)&r->sa;
+  if (r->ai.ai_family == AF_INET)
+    {
+      in->sin_port		= htons(n);
+      r->ai.ai_addrlen		= sizeof *in;
+    }
+  else
+    {
+      in6->sin6_port		= htons(n);
+      r->ai.ai_addrlen		= sizeof *in6;
+    }
+  *res	= &r->ai;
+  return 0;
+#endif
+}
+
+P(freeaddrinfo, void, struct addrinfo *ai)
+{
+#ifndef	PASSFD_NUMERIC
+  freeaddrinfo(ai);
+#else
+  PFD_free(_, ai);
+#endif
+}
+
+
+/***********************************************************************
+ * FD factories
+ *
+ * Instead of an FD number, mode i can be given a spec to create the FD:
+ *
+ *	type[,opt[=val]..][@keep][:arg]
+ *
+ * The created FD is passed.  With @keep the (other end of the) object
+ * also is kept open as FD keep for the forked command.
+ **********************************************************************/
+
+#define	PFD_FDSPEC_MORE	63
+
+struct PFD_fdspec
+  {
+    char	*type;
+    char	*opts;		/* opt[=val],.. or NULL	*/
+    int		keep;		/* -1 if not given	*/
+    const char	*arg;		/* after ':' or NULL	*/
+    int		more[PFD_FDSPEC_MORE], nmore;	/* additional FDs to pass	*/
+  };
+
+struct PFD_factory
+  {
+    const char	*type;
+    const char	*opts;		/* known options, each followed by a blank	*/
+    int		(*create)(struct PFD_passfd *, struct PFD_fdspec *);
+  };
+
+/* Next opt[=val] in a list or NULL
+ */
+P(fdopt_next, const char *, const char *s)
+{
+  s	= strchr(s, ',');
+  return s ? s+1 : s;
+}
+
+/* Get option, "" if it has no value, NULL if not present
+ */
+P(fdopt, const char *, struct PFD_fdspec *f, const char *name)
+{
+  const char	*s;
+  size_t	len;
+
+  len	= strlen(name);
+  for (s=f->opts; s; s=PFD_fdopt_next(_, s))
+    if (!strncmp(s, name, len) && (!s[len] || s[len]==',' || s[len]=='='))
+      {
+        static char	val[64];
+        const char	*e;
+
+        if (s[len] != '=')
+          return "";
+        s	+= len+1;
+        e	= strchr(s, ',');
+        len	= e ? (size_t)(e-s) : strlen(s);
+        if (len >= sizeof val)
+          PFD_OOPS(_, "option value too long: %s", name);
+        memcpy(val, s, len);
+        val[len]	= 0;
+        return val;
+      }
+  return 0;
+}
+
+/* Numeric option with optional suffix k M G (1024 based)
+ */
+P(fdopt_num, long long, struct PFD_fdspec *f, const char *name, long long def)
+{
+  const char	*s;
+  char		*end;
+  long long	n;
+
+  s	= PFD_fdopt(_, f, name);
+  if (!s)
+    return def;
+  n	= strtoll(s, &end, 0);
+  switch (*end)
+    {
+    case 'G':	n	*= 1024;	/*fallthru*/
+    case 'M':	n	*= 1024;	/*fallthru*/
+    case 'k':	n	*= 1024;	end++;
+    }
+  if (!*s || *end || n<0)
+    PFD_OOPS(_, "%s: option %s needs a number: %s", f->type, name, s);
+  return n;
+}
+
+/* Keep FD for the forked command, too
+ *
+ * pass[] are the other FDs of this spec which are passed.
+ * If one of them sits at keep, it is moved away first.
+ * Any other FD at keep is not ours, so it is not overwritten.
+ */
+P(fdkeep, void, struct PFD_fdspec *f, int fd, int *pass, int n)
+{
+  int	i;
+
+  if (f->keep<0)
+    return;
+  if (fd == f->keep)
+    PFD_cloexec(_, fd, 1);
+  else
+    {
+      if (fcntl(f->keep, F_GETFD)>=0)
+        {
+          for (i=0; i<n && pass[i] != f->keep; i++);
+          if (i>=n)
+            PFD_OOPS(_, "%s: cannot keep %d as %d: FD in use", f->type, fd, f->keep);
+          if ((pass[i] = fcntl(f->keep, F_DUPFD_CLOEXEC, 0))<0)
+            PFD_OOPS(_, "%s: cannot move %d", f->type, f->keep);
+          PFD_V(_, "%s: moved %d to %d", f->type, f->keep, pass[i]);
+        }
+      if (dup2(fd, f->keep)<0)
+        PFD_OOPS(_, "%s: cannot keep %d as %d", f->type, fd, f->keep);
+    }
+  PFD_V(_, "%s: keep %d as %d", f->type, fd, f->keep);
+
+  /* main_i() must not close it, even if it is passed, too	*/
+  PFD_ints_add(_, &_->kept, f->keep);
+}
+
+/* memfd[,noseal][@keep][:file]
+ *
+ * Read file (default: STDIN) once into a sealed memfd.
+ * Receivers can mmap() it (MAP_SHARED, PROT_READ) without copying.
+ * noseal leaves it writable, so it can be used as shared memory.
+ */
+P(fd_memfd, int, struct PFD_fdspec *f)
+{
+#ifdef	MFD_ALLOW_SEALING
+  char		buf[65536];
+  off_t		total;
+  int		fd, src, splice;
+
+  src	= 0;
+  if (f->arg && strcmp(f->arg, "-") && (src = open(f->arg, O_RDONLY|O_CLOEXEC))<0)
+    PFD_OOPS(_, "memfd: cannot open %s", f->arg);
+
+  fd	= memfd_create("passfd", MFD_CLOEXEC|MFD_ALLOW_SEALING);
+  if (fd<0)
+    PFD_OOPS(_, "memfd_create() failed");
+
+  for (total=0, splice=1;;)
+    {
+      ssize_t	got, put;
+      char	*p;
+
+      /* sendfile() avoids the copy through userspace for regular files	*/
+      if (splice)
+        {
+          got	= sendfile(fd, src, NULL, 1<<30);
+          if (got>0)
+            {
+              total	+= got;
+              continue;
+            }
+          if (!got)
+            break;
+          if (errno == EINTR)
+            continue;
+          if (errno != EINVAL && errno != ENOSYS)
+            PFD_OOPS(_, "memfd: read error");
+          splice	= 0;
+        }
+
+      got	= read(src, buf, sizeof buf);
+      if (!got)
+        break;
+      if (got<0)
+        {
+          if (errno == EINTR)
+            continue;
+          PFD_OOPS(_, "memfd: read error");
+        }
+      for (p=buf; got; got-=put, p+=put)
+        if ((put = write(fd, p, got))<0)
+          PFD_OOPS(_, "memfd: write error");
+        else
+          total	+= put;
+    }
+  if (src)
+    close(src);
+
+  if (!PFD_fdopt(_, f, "noseal") && fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK|F_SEAL_GROW|F_SEAL_WRITE|F_SEAL_SEAL))
+    PFD_OOPS(_, "memfd: cannot seal");
+  if (lseek(fd, (off_t)0, SEEK_SET))
+    PFD_OOPS(_, "memfd: cannot rewind");
+  PFD_V(_, "memfd %d: %lld bytes", fd, (long long)total);
+  PFD_fdkeep(_, f, fd, NULL, 0);
+  return fd;
+#else
+  PFD_OOPS(_, "memfd not supported on this platform");
+  return -1;
+#endif
+}
+
+/* Pass one end of a pair, keep the other (or close it)
+ */
+P(fdpair, int, struct PFD_fdspec *f, int pass, int other)
+{
+  PFD_fdkeep(_, f, other, &pass, 1);
+  if (other != f->keep)
+    close(other);
+  return pass;
+}
+
+/* socketpair[,stream|dgram|seqpacket][,nonblock][@keep]
+ *
+ * Pass one end, keep the other.
+ */
+P(fd_socketpair, int, struct PFD_fdspec *f)
+{
+  int	sv[2], type;
+
+  type	= SOCK_STREAM;
+  if (PFD_fdopt(_, f, "dgram"))
+    type	= SOCK_DGRAM;
+  if (PFD_fdopt(_, f, "seqpacket"))
+    type	= SOCK_SEQPACKET;
+  if (socketpair(AF_UNIX, type, 0, sv))
+    PFD_OOPS(_, "socketpair() failed");
+  PFD_cloexec(_, sv[0], 0);
+  PFD_cloexec(_, sv[1], 0);
+  if (PFD_fdopt(_, f, "nonblock"))
+    {
+      PFD_nonblock(_, sv[0]);
+      PFD_nonblock(_, sv[1]);
+    }
+  PFD_V(_, "socketpair %d %d", sv[0], sv[1]);
+  return PFD_fdpair(_, f, sv[0], sv[1]);
+}
+
+#ifdef	__linux__
+/* pipe[,size=N|max][,direct][,nonblock][,r][@keep]
+ *
+ * Pass the write end (r: the read end), keep the other.
+ * size is limited to /proc/sys/fs/pipe-max-size unless CAP_SYS_RESOURCE.
+ */
+P(fd_pipe, int, struct PFD_fdspec *f)
+{
+  const char	*size;
+  int		p[2], flags, r;
+
+  flags	= O_CLOEXEC;
+  if (PFD_fdopt(_, f, "direct"))
+    flags	|= O_DIRECT;	/* packet mode	*/
+  if (PFD_fdopt(_, f, "nonblock"))
+    flags	|= O_NONBLOCK;
+  if (pipe2(p, flags))
+    PFD_OOPS(_, "pipe2() failed");
+
+  size	= PFD_fdopt(_, f, "size");
+  if (size)
+    {
+      long long	n, max;
+      char	buf[32];
+
+      if (PFD_readfile(_, "/proc/sys/fs/pipe-max-size", buf, sizeof buf)<=0 || (max = atoll(buf))<=0)
+        max	= 1024*1024;
+      n	= strcmp(size, "max") ? PFD_fdopt_num(_, f, "size", 0) : max;
+      if (n > INT_MAX || fcntl(p[0], F_SETPIPE_SZ, (int)n)<0)
+        {
+          if (n <= max || (n <= INT_MAX && errno != EPERM))
+            PFD_OOPS(_, "pipe: cannot set size %lld", n);
+          PFD_V(_, "pipe: size %lld exceeds pipe-max-size %lld", n, max);
+          if (fcntl(p[0], F_SETPIPE_SZ, (int)max)<0)
+            PFD_OOPS(_, "pipe: cannot set size %lld", max);
+        }
+    }
+
+  r	= PFD_fdopt(_, f, "r") ? 0 : 1;
+  PFD_V(_, "pipe %d %d: size %d", p[0], p[1], fcntl(p[0], F_GETPIPE_SZ));
+  return PFD_fdpair(_, f, p[r], p[!r]);
+}
+
+/* eventfd[,init=N][,semaphore][,nonblock][@keep]
+ */
+P(fd_eventfd, int, struct PFD_fdspec *f)
+{
+  int	fd, flags;
+
+  flags	= EFD_CLOEXEC;
+  if (PFD_fdopt(_, f, "semaphore"))
+    flags	|= EFD_SEMAPHORE;
+  if (PFD_fdopt(_, f, "nonblock"))
+    flags	|= EFD_NONBLOCK;
+  fd	= eventfd((unsigned)PFD_fdopt_num(_, f, "init", 0), flags);
+  if (fd<0)
+    PFD_OOPS(_, "eventfd() failed");
+  PFD_V(_, "eventfd %d", fd);
+  PFD_fdkeep(_, f, fd, NULL, 0);
+  return fd;
+}
+
+/* timerfd[,realtime][,value=ms][,interval=ms][,nonblock][@keep]
+ *
+ * value defaults to interval, the timer is disarmed if both are 0
+ */
+P(fd_timerfd, int, struct PFD_fdspec *f)
+{
+  struct itimerspec	its;
+  long long		val, ival;
+  int			fd;
+
+  fd	= timerfd_create(PFD_fdopt(_, f, "realtime") ? CLOCK_REALTIME : CLOCK_MONOTONIC,
+                         TFD_CLOEXEC | (PFD_fdopt(_, f, "nonblock") ? TFD_NONBLOCK : 0));
+  if (fd<0)
+    PFD_OOPS(_, "timerfd_create() failed");
+  ival	= PFD_fdopt_num(_, f, "interval", 0);
+  val	= PFD_fdopt_num(_, f, "value", ival);
+  its.it_interval.tv_sec	= ival / 1000;
+  its.it_interval.tv_nsec	= ival % 1000 * 1000000;
+  its.it_value.tv_sec		= val / 1000;
+  its.it_value.tv_nsec		= val % 1000 * 1000000;
+  if (timerfd_settime(fd, 0, &its, NULL))
+    PFD_OOPS(_, "timerfd_settime() failed");
+  PFD_V(_, "timerfd %d: %lldms %lldms", fd, val, ival);
+  PFD_fdkeep(_, f, fd, NULL, 0);
+  return fd;
+}
+
+/* ring[,size=N][,huge][@keep]
+ *
+ * Shared memory ring, see shmring.h.
+ * Passes 3 FDs: memfd, data doorbell, space doorbell (eventfds),
+ * @keep keeps them as keep, keep+1, keep+2.
+ * size is rounded up to a power of 2 (default 1M).
+ * huge uses huge pages if available.
+ */
+P(fd_ring, int, struct PFD_fdspec *f)
+{
+  long long	size, off, n;
+  int		fd, fds[3], i;
+
+  size	= PFD_fdopt_num(_, f, "size", 1024*1024);
+  if (size > (1LL<<40))
+    PFD_OOPS(_, "ring: size too big: %lld", size);
+  for (n=4096; n<size; n*=2);
+  size	= n;
+
+  fd	= -1;
+#ifdef	MFD_HUGETLB
+  if (PFD_fdopt(_, f, "huge"))
+    {
+      void	*m;
+
+      off	= 2*1024*1024;	/* header gets a huge page of its own	*/
+      if (size < off)
+        size	= off;
+      /* mmap() fails if there are not enough huge pages	*/
+      if ((fd = memfd_create("passfd-ring", MFD_CLOEXEC|MFD_HUGETLB))>=0 && !ftruncate(fd, off+size)
+          && (m = mmap(NULL, off+size, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0)) != MAP_FAILED)
+        munmap(m, off+size);
+      else
+        {
+          PFD_V(_, "ring: no huge pages");
+          if (fd>=0)
+            close(fd);
+          fd	= -1;
+        }
+    }
+#endif
+  if (fd<0)
+    {
+      off	= 4096;
+      fd	= memfd_create("passfd-ring", MFD_CLOEXEC);
+      if (fd<0 || ftruncate(fd, off+size))
+        PFD_OOPS(_, "ring: cannot create memfd of %lld bytes", off+size);
+    }
+  if (shmring_format(fd, off, size))
+    PFD_OOPS(_, "ring: cannot initialize");
+  PFD_fdkeep(_, f, fd, NULL, 0);
+
+  fds[0]	= fd;
+  for (i=1; i<3; i++)
+    {
+      if ((fds[i] = eventfd(0, EFD_CLOEXEC))<0)
+        PFD_OOPS(_, "eventfd() failed");
+      if (f->keep>=0)
+        {
+          f->keep++;
+          PFD_fdkeep(_, f, fds[i], fds, i);
+        }
+    }
+  if (f->keep>=0)
+    f->keep	-= 2;
+  f->more[0]	= fds[1];
+  f->more[1]	= fds[2];
+  f->nmore	= 2;
+  PFD_V(_, "ring %d %d %d: %lld bytes", fds[0], fds[1], fds[2], size);
+  return fds[0];
+}
+#endif
+
+/* Resolve [host]:port for udp, empty host is any
+ */
+P(udp_ai, struct addrinfo *, const char *addr, int family, int flags)
+{
+  struct addrinfo	hints, *ai;
+  char			buf[256], *host, *port;
+  int			err;
+
+  if (strlen(addr) >= sizeof buf || !(port = strrchr(strcpy(buf, addr), ':')))
+    PFD_OOPS(_, "udp: need host:port: %s", addr);
+  *port++	= 0;
+  host		= buf;
+  if (*host == '[' && port > buf+2 && port[-2] == ']')
+    {
+      host++;
+      port[-2]	= 0;
+    }
+  memset(&hints, 0, sizeof hints);
+  hints.ai_family	= family;
+  hints.ai_socktype	= SOCK_DGRAM;
+  hints.ai_flags	= flags;
+  if ((err = PFD_getaddrinfo(_, *host ? host : NULL, port, &hints, &ai))!=0)
+    PFD_OOPS(_, "udp: cannot resolve %s: %s", addr, gai_strerror(err));
+  return ai;
+}
+
+/* SO_RCVBUF/SO_SNDBUF, above the sysctl limit with SO_*BUFFORCE if permitted
+ */
+P(sockbuf, void, int fd, int rcv, long long n)
+{
+  socklen_t	len;
+  int		v, got;
+
+  if (!n)
+    return;
+  if (n > INT_MAX/2)
+    PFD_OOPS(_, "%s too big: %lld", rcv ? "rcvbuf" : "sndbuf", n);
+  v	= n;
+  if (setsockopt(fd, SOL_SOCKET, rcv ? SO_RCVBUF : SO_SNDBUF, &v, sizeof v))
+    PFD_OOPS(_, "cannot set %s %d", rcv ? "rcvbuf" : "sndbuf", v);
+  len	= sizeof got;
+  if (getsockopt(fd, SOL_SOCKET, rcv ? SO_RCVBUF : SO_SNDBUF, &got, &len) || got >= v)
+    return;
+#ifdef	SO_RCVBUFFORCE
+  if (!setsockopt(fd, SOL_SOCKET, rcv ? SO_RCVBUFFORCE : SO_SNDBUFFORCE, &v, sizeof v))
+    return;
+#endif
+  PFD_V(_, "%s %d: limited to %d", rcv ? "rcvbuf" : "sndbuf", fd, got);
+}
+
+/* udp[,reuseport[=N]][,gso=N][,gro][,rcvbuf=N][,sndbuf=N][,nonblock][@keep]:[host]:port[/peer:port]
+ *
+ * UDP socket bound to host:port (empty host: any) and connected to peer.
+ * Without host:port it is only connected, without /peer only bound.
+ * reuseport=N creates an SO_REUSEPORT group of N sockets, all are passed,
+ * @keep keeps them as keep..keep+N-1.
+ * gso is the UDP_SEGMENT size, gro enables UDP_GRO (both Linux).
+ */
+P(fd_udp, int, struct PFD_fdspec *f)
+{
+  struct addrinfo	*local, *peer, *ai;
+  const char		*reuse;
+  char			*tmp, *at;
+  long long		n, gso, rcvbuf, sndbuf;
+  int			fd, fds[PFD_FDSPEC_MORE+1], i, keep, on = 1;
+
+  if (!f->arg)
+    PFD_OOPS(_, "udp: needs :host:port");
+  tmp	= PFD_dup(_, f->arg);
+  if ((at = strchr(tmp, '/'))!=0)
+    *at++	= 0;
+  local	= *tmp ? PFD_udp_ai(_, tmp, AF_UNSPEC, AI_PASSIVE) : 0;
+  peer	= at ? PFD_udp_ai(_, at, local ? local->ai_family : AF_UNSPEC, 0) : 0;
+  if (!local && !peer)
+    PFD_OOPS(_, "udp: needs host:port or /peer:port");
+  ai	= local ? local : peer;
+
+  reuse		= PFD_fdopt(_, f, "reuseport");
+  n		= reuse && *reuse ? PFD_fdopt_num(_, f, "reuseport", 1) : 1;
+  if (n<1 || n > PFD_FDSPEC_MORE+1)
+    PFD_OOPS(_, "udp: reuseport group must be 1 to %d sockets", PFD_FDSPEC_MORE+1);
+  gso		= PFD_fdopt_num(_, f, "gso", 0);
+  rcvbuf	= PFD_fdopt_num(_, f, "rcvbuf", 0);
+  sndbuf	= PFD_fdopt_num(_, f, "sndbuf", 0);
+#ifndef	UDP_SEGMENT
+  if (gso || PFD_fdopt(_, f, "gro"))
+    PFD_OOPS(_, "udp: gso and gro are not supported on this platform");
+#endif
+
+  keep	= f->keep;
+  for (i=0; i<n; i++)
+    {
+      fd	= PFD_socket(_, ai->ai_family, SOCK_DGRAM);
+      if (fd<0)
+        PFD_OOPS(_, "udp: socket() failed");
+      PFD_cloexec(_, fd, 0);
+      if (reuse)
+#ifdef	SO_REUSEPORT
+        if (setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &on, sizeof on))
+#endif
+          PFD_OOPS(_, "udp: cannot set SO_REUSEPORT");
+#ifdef	UDP_SEGMENT
+      if (gso)
+        {
+          int	v = gso;
+
+          if (gso > 65535 || setsockopt(fd, IPPROTO_UDP, UDP_SEGMENT, &v, sizeof v))
+            PFD_OOPS(_, "udp: cannot set gso %lld", gso);
+        }
+      if (PFD_fdopt(_, f, "gro") && setsockopt(fd, IPPROTO_UDP, UDP_GRO, &on, sizeof on))
+        PFD_OOPS(_, "udp: cannot set gro");
+#endif
+      PFD_sockbuf(_, fd, 1, rcvbuf);
+      PFD_sockbuf(_, fd, 0, sndbuf);
+      if (local && bind(fd, local->ai_addr, local->ai_addrlen))
+        PFD_OOPS(_, "udp: cannot bind %s", tmp);
+      if (peer && connect(fd, peer->ai_addr, peer->ai_addrlen))
+        PFD_OOPS(_, "udp: cannot connect %s", at);
+      if (PFD_fdopt(_, f, "nonblock"))
+        PFD_nonblock(_, fd);
+      PFD_V(_, "udp %d: %s", fd, f->arg);
+
+      fds[i]	= fd;
+      f->keep	= keep<0 ? keep : keep+i;
+      PFD_fdkeep(_, f, fd, fds, i);
+    }
+  f->keep	= keep;
+  for (i=1; i<n; i++)
+    f->more[f->nmore++]	= fds[i];
+
+  if (local)
+    PFD_freeaddrinfo(_, local);
+  if (peer)
+    PFD_freeaddrinfo(_, peer);
+  PFD_free(_, tmp);
+  return fds[0];
+}
+
+static const struct PFD_factory PFD_factories[] =
+  {
+    { "memfd",		"noseal ",	PFD_fd_memfd },
+    { "socketpair",	"stream dgram seqpacket nonblock ",	PFD_fd_socketpair },
+    { "udp",		"reuseport gso gro rcvbuf sndbuf nonblock ",	PFD_fd_udp },
+#ifdef	__linux__
+    { "pipe",		"size direct nonblock r ",		PFD_fd_pipe },
+    { "eventfd",	"init semaphore nonblock ",		PFD_fd_eventfd },
+    { "timerfd",	"realtime value interval nonblock ",	PFD_fd_timerfd },
+    { "ring",		"size huge ",				PFD_fd_ring },
+#endif
+  };
+
+/* Create FD from spec and append it to integer list *i
+ */
+P(factory, void, int **i, const char *spec)
+{
+  struct PFD_fdspec	f;
+  char			*s, *tmp;
+  int			k;
+
+  s		= PFD_dup(_, spec);
+  f.arg		= 0;
+  f.keep	= -1;
+  f.opts	= 0;
+  f.nmore	= 0;
+  if ((tmp = strchr(s, ':'))!=0)
+    {
+      *tmp++	= 0;
+      f.arg	= spec + (tmp-s);
+    }
+  if ((tmp = strchr(s, '@'))!=0)
+    {
+      *tmp++	= 0;
+      f.keep	= PFD_int(_, tmp);
+    }
+  if ((tmp = strchr(s, ','))!=0)
+    {
+      *tmp++	= 0;
+      f.opts	= tmp;
+    }
+  f.type	= s;
+
+  for (k=0; k<(int)(sizeof PFD_factories / sizeof *PFD_factories); k++)
+    if (!strcmp(PFD_factories[k].type, f.type))
+      {
+        const struct PFD_factory	*fa = &PFD_factories[k];
+        const char			*o;
+
+        /* check options	*/
+        for (o=f.opts; o; o=PFD_fdopt_next(_, o))
+          {
+            size_t	len;
+            const char	*known;
+
+            len	= strcspn(o, ",=");
+            for (known=fa->opts; *known; known += strcspn(known, " ")+1)
+              if (!strncmp(known, o, len) && known[len] == ' ')
+                break;
+            if (!len || !*known)
+              PFD_OOPS(_, "%s: unknown option: %.*s", f.type, (int)strcspn(o, ","), o);
+          }
+
+        PFD_ints_add(_, i, fa->create(_, &f));
+        for (k=0; k<f.nmore; k++)
+          PFD_ints_add(_, i, f.more[k]);
+        PFD_free(_, s);
+        return;
+      }
+  PFD_OOPS(_, "unknown FD type: %s", f.type);
+}
+
+
+/***********************************************************************
+ * File helpers
+ **********************************************************************/
+
+/* Read a (small) file into buf, NUL terminated, without stdio.
+ * returns the length or -1
+ */
+P(readfile, ssize_t, const char *name, char *buf, size_t max)
+{
+  ssize_t	got, len;
+  int		fd;
+
+  if ((fd = open(name, O_RDONLY|O_CLOEXEC))<0)
+    return -1;
+  for (len=0; (size_t)len < max-1; len += got)
+    if ((got = read(fd, buf+len, max-1-len))<=0)
+      {
+        if (!got)
+          break;
+        if (errno == EINTR)
+          {
+            got	= 0;
+            continue;
+          }
+        close(fd);
+        return -1;
+      }
+  close(fd);
+  buf[len]	= 0;
+  return len;
+}
+
+P(close, void, int sock, const char *name)
+{
+  for (;;)
+    {
+      if (!close(sock))
+        {
+          PFD_V(_, "close %d: %s", sock, name);
+          if (sock == _->sock)
+            _->sock	= -1;
+          return;
+        }
+      if (errno != EINTR)
+        PFD_OOPS(_, "close %d fail: %s", sock, name);
+      PFD_V(_, "close %d interrupted: %s", sock, name);
+    }
+}
+
 
 /***********************************************************************
  * Setters
@@ -479,7 +1834,10 @@ P(recfds, void, int *fds)
 {
   if (_->recfds)
     PFD_free(_, _->recfds);
+  if (_->recmeta)
+    PFD_free(_, _->recmeta);
   _->recfds	= fds;
+  _->recmeta	= 0;
 }
 
 P(sockname, void, const char *name)
@@ -491,6 +1849,17 @@ P(sockname, void, const char *name)
   _->sockname	= name;
 }
 
+/* Set environment for the forked command, unless q
+ */
+P(setenv, void, const char *name, const char *val)
+{
+  if (_->quiet)
+    return;
+  if (setenv(name, val, 1))
+    PFD_OOPS(_, "cannot set environment: %s", name);
+  PFD_V(_, "%s=%s", name, val);
+}
+
 P(sock, void, int fd)
 {
   if (fd<0)
@@ -502,24 +1871,333 @@ P(sock, void, int fd)
   _->sock	= fd;
 }
 
+/* PASSFD_NETNS=path|FD: create sockets in this network namespace.
+ * Only socket() runs there, bind() and connect() then use its stack.
+ */
+P(netns_init, void)
+{
+  const char	*s;
+
+  _->netns	= -1;
+  _->netns0	= -1;
+  s		= getenv("PASSFD_NETNS");
+  if (!s || !*s)
+    return;
+#ifdef	__linux__
+  _->netns	= isdigit(*s) ? PFD_int(_, s) : open(s, O_RDONLY|O_CLOEXEC);
+  if (_->netns<0)
+    PFD_OOPS(_, "PASSFD_NETNS: cannot open %s", s);
+  _->netns0	= open("/proc/self/ns/net", O_RDONLY|O_CLOEXEC);
+  if (_->netns0<0)
+    PFD_OOPS(_, "PASSFD_NETNS: cannot open /proc/self/ns/net");
+#else
+  PFD_OOPS(_, "PASSFD_NETNS: network namespaces are Linux only");
+#endif
+}
+
+P(socket_proto, int, int domain, int type, int proto)
+{
+#ifdef	__linux__
+  if (_->netns>=0)
+    {
+      int	fd, e;
+
+      if (setns(_->netns, CLONE_NEWNET))
+        PFD_OOPS(_, "setns() error: PASSFD_NETNS");
+      fd	= socket(domain, type, proto);
+      e		= errno;
+      if (setns(_->netns0, CLONE_NEWNET))
+        PFD_OOPS(_, "setns() error: cannot return to own network namespace");
+      PFD_V(_, "socket %d created in PASSFD_NETNS", fd);
+      errno	= e;
+      return fd;
+    }
+#endif
+  return socket(domain, type, proto);
+}
+
+P(socket, int, int domain, int type)
+{
+#ifdef	IPPROTO_MPTCP
+  if (_->mptcp && type == SOCK_STREAM && (domain == AF_INET || domain == AF_INET6))
+    {
+      int	fd;
+
+      fd	= PFD_socket_proto(_, domain, type, IPPROTO_MPTCP);
+      if (fd>=0)
+        return fd;
+      PFD_V(_, "MPTCP refused, fallback to TCP");
+    }
+#endif
+  return PFD_socket_proto(_, domain, type, 0);
+}
+
+
+/***********************************************************************
+ * MPTCP (option m)
+ *
+ * With m, TCP sockets are created as IPPROTO_MPTCP (see PFD_socket()).
+ * PASSFD_MPTCP=addr[,addr..] adds subflow endpoints to the in-kernel
+ * path manager with generic netlink (like "ip mptcp endpoint add addr subflow").
+ * This needs CAP_NET_ADMIN and stays after passfd terminates.
+ **********************************************************************/
+
+#ifdef	MPTCP_PM_NAME
+struct PFD_nlreq
+  {
+    struct nlmsghdr	n;
+    struct genlmsghdr	g;
+    char		buf[128];
+  };
+
+/* Append attribute to request, returns it (for nesting)
+ */
+P(nla, struct nlattr *, struct PFD_nlreq *r, int type, const void *data, int len)
+{
+  struct nlattr	*a;
+
+  if (NLMSG_ALIGN(r->n.nlmsg_len) + NLA_HDRLEN + len > sizeof *r)
+    PFD_OOPS(_, "netlink request too long");
+  a		= (struct nlattr *)((char *)r + NLMSG_ALIGN(r->n.nlmsg_len));
+  a->nla_type	= type;
+  a->nla_len	= NLA_HDRLEN + len;
+  if (len)
+    memcpy((char *)a + NLA_HDRLEN, data, len);
+  r->n.nlmsg_len	= NLMSG_ALIGN(r->n.nlmsg_len) + NLA_ALIGN(a->nla_len);
+  return a;
+}
+
+P(nl_init, void, struct PFD_nlreq *r, int type, int flags, int cmd, int version)
+{
+  memset(r, 0, sizeof *r);
+  r->n.nlmsg_len	= NLMSG_LENGTH(GENL_HDRLEN);
+  r->n.nlmsg_type	= type;
+  r->n.nlmsg_flags	= NLM_F_REQUEST | flags;
+  r->g.cmd		= cmd;
+  r->g.version		= version;
+}
+
+/* Send request, read one reply.
+ * returns 0 or -errno of the kernel's NLMSG_ERROR
+ */
+P(nl_talk, int, int fd, struct PFD_nlreq *r, struct nlmsghdr *rep, size_t max)
+{
+  ssize_t	got;
+
+  if (send(fd, r, r->n.nlmsg_len, 0) != (ssize_t)r->n.nlmsg_len)
+    return -errno;
+  while ((got = recv(fd, rep, max, 0))<0)
+    if (errno != EINTR)
+      return -errno;
+  if (!NLMSG_OK(rep, (size_t)got))
+    return -EBADMSG;
+  if (rep->nlmsg_type == NLMSG_ERROR)
+    return ((struct nlmsgerr *)NLMSG_DATA(rep))->error;
+  return 0;
+}
+
+/* returns the generic netlink family of the path manager or -1
+ */
+P(mptcp_family, int, int fd)
+{
+  struct PFD_nlreq	r;
+  union
+    {
+      struct nlmsghdr	n;
+      char		buf[4096];	/* attributes beyond are not needed	*/
+    }			rep;
+  struct nlattr		*a;
+  int			len, err;
+
+  PFD_nl_init(_, &r, GENL_ID_CTRL, 0, CTRL_CMD_GETFAMILY, 1);
+  PFD_nla(_, &r, CTRL_ATTR_FAMILY_NAME, MPTCP_PM_NAME, sizeof MPTCP_PM_NAME);
+  if ((err = PFD_nl_talk(_, fd, &r, &rep.n, sizeof rep))!=0)
+    {
+      errno	= -err;
+      return -1;
+    }
+  len	= rep.n.nlmsg_len - NLMSG_LENGTH(GENL_HDRLEN);
+  for (a = (struct nlattr *)((char *)NLMSG_DATA(&rep.n) + GENL_HDRLEN);
+       len >= NLA_HDRLEN && a->nla_len >= NLA_HDRLEN && a->nla_len <= len;
+       len -= NLA_ALIGN(a->nla_len), a = (struct nlattr *)((char *)a + NLA_ALIGN(a->nla_len)))
+    if ((a->nla_type & NLA_TYPE_MASK) == CTRL_ATTR_FAMILY_ID)
+      return *(uint16_t *)((char *)a + NLA_HDRLEN);
+  errno	= ENOENT;
+  return -1;
+}
+
+/* returns 0 or -errno
+ */
+P(mptcp_endpoint, int, int fd, int family, const char *addr)
+{
+  struct PFD_nlreq	r;
+  struct nlmsghdr	rep[64];
+  struct nlattr		*nest;
+  struct in6_addr	ip;
+  uint32_t		flags;
+  uint16_t		af;
+
+  af	= AF_INET;
+  if (inet_pton(AF_INET, addr, &ip) != 1)
+    {
+      af	= AF_INET6;
+      if (inet_pton(AF_INET6, addr, &ip) != 1)
+        PFD_OOPS(_, "PASSFD_MPTCP: not an IP address: %s", addr);
+    }
+  flags	= MPTCP_PM_ADDR_FLAG_SUBFLOW;
+
+  PFD_nl_init(_, &r, family, NLM_F_ACK, MPTCP_PM_CMD_ADD_ADDR, MPTCP_PM_VER);
+  nest	= PFD_nla(_, &r, MPTCP_PM_ATTR_ADDR | NLA_F_NESTED, NULL, 0);
+  PFD_nla(_, &r, MPTCP_PM_ADDR_ATTR_FAMILY, &af, sizeof af);
+  PFD_nla(_, &r, af == AF_INET ? MPTCP_PM_ADDR_ATTR_ADDR4 : MPTCP_PM_ADDR_ATTR_ADDR6, &ip, af == AF_INET ? 4 : 16);
+  PFD_nla(_, &r, MPTCP_PM_ADDR_ATTR_FLAGS, &flags, sizeof flags);
+  nest->nla_len	= (char *)&r + r.n.nlmsg_len - (char *)nest;
+  return PFD_nl_talk(_, fd, &r, rep, sizeof rep);
+}
+#endif
+
+P(mptcp_init, void)
+{
+  const char	*s;
+
+  s	= getenv("PASSFD_MPTCP");
+  if (!s || !*s)
+    return;
+#ifdef	MPTCP_PM_NAME
+  {
+    char	*names, *tmp, *x;
+    int		fd, family;
+
+    fd	= PFD_socket_proto(_, AF_NETLINK, SOCK_RAW, NETLINK_GENERIC);
+    if (fd<0 || (family = PFD_mptcp_family(_, fd))<0)
+      {
+        PFD_warn(_, "PASSFD_MPTCP: no MPTCP path manager");
+        if (fd>=0)
+          close(fd);
+        return;
+      }
+    names	= PFD_dup(_, s);
+    for (tmp=strtok_r(names, ",", &x); tmp; tmp=strtok_r(NULL, ",", &x))
+      {
+        int	err;
+
+        err	= PFD_mptcp_endpoint(_, fd, family, tmp);
+        if (err == -EEXIST || err == -EBUSY)
+          PFD_V(_, "MPTCP endpoint %s: exists", tmp);
+        else if (!err)
+          PFD_V(_, "MPTCP endpoint %s: added", tmp);
+        else
+          {
+            errno	= -err;
+            PFD_warn(_, "PASSFD_MPTCP: cannot add endpoint %s", tmp);
+          }
+      }
+    PFD_free(_, names);
+    close(fd);
+  }
+#else
+  PFD_OOPS(_, "PASSFD_MPTCP: MPTCP endpoints are not supported on this platform");
+#endif
+}
+
 
 /***********************************************************************
  * Child execution
  **********************************************************************/
 
+/* No FDs given: use the targets sent along.
+ * FDs with target go first, the others stay where they are received.
+ * The sender is not trusted: duplicate or negative targets are refused.
+ */
+P(targets, void)
+{
+  int	i, k, n;
+
+  n	= _->recfds[0];
+  for (i=0; i<n; i++)
+    {
+      if (_->recmeta[i].target < -1)
+        PFD_OOPS(_, "invalid target received: %d", _->recmeta[i].target);
+      for (k=0; k<i && _->recmeta[i].target>=0; k++)
+        if (_->recmeta[k].target == _->recmeta[i].target)
+          PFD_OOPS(_, "duplicate target received: %d", _->recmeta[i].target);
+    }
+  for (k=i=0; i<n; i++)
+    if (_->recmeta[i].target>=0)
+      {
+        struct pfdwire_fd	m;
+        int			fd;
+
+        fd			= _->recfds[i+1];
+        m			= _->recmeta[i];
+        memmove(_->recfds+k+2, _->recfds+k+1, (i-k) * sizeof *_->recfds);
+        memmove(_->recmeta+k+1, _->recmeta+k, (i-k) * sizeof *_->recmeta);
+        _->recfds[k+1]		= fd;
+        _->recmeta[k]		= m;
+        k++;
+      }
+  if (_->fds)
+    _->fds[0]	= 0;
+  for (i=0; i<k; i++)
+    PFD_ints_add(_, &_->fds, _->recmeta[i].target);
+  PFD_V(_, "using %d of %d targets sent", k, n);
+}
+
+/* PASSFD_FDNAMES=fd=name:fd=name.. of the received named FDs
+ */
+P(fdnames, void)
+{
+  char	*buf;
+  size_t	max;
+  int	i, n;
+
+  if (!_->recmeta)
+    return;
+  n	= _->recfds[0];
+  max	= n * (PFDWIRE_NAME + 12) + 1;
+  buf	= PFD_alloc(_, max);
+  buf[0]	= 0;
+  for (i=0; i<n; i++)
+    if (_->recmeta[i].name[0])
+      PFD_append(_, buf, max, "%s%d=%s", buf[0] ? ":" : "", _->recfds[i+1], _->recmeta[i].name);
+  PFD_setenv(_, "PASSFD_FDNAMES", buf);
+  PFD_free(_, buf);
+}
+
 /* Map _->recfds according to _->fds into space
  * returning FD which represents previous FD2
  */
 P(map, int)
 {
-  int	fd2	= 2;
-  int	i, n0, n1;
-  char	where[200];
-
+  int		fd2	= 2;
+  int		i, n0, n1, max;
+  char		where[200];
+  uint64_t	t0;
+
+  t0	= PFD_PROBE_T0(map);
+  if (!_->fds[0] && _->recmeta)
+    PFD_targets(_);
   n0	= _->fds[0];
   n1	= _->recfds[0];
   if (n1 < n0)
     PFD_OOPS(_, "too few FDs received, got %d, expected at least %d", n1, n0);
+
+  /* move FDs out of the way, so dup2() does not overwrite them	*/
+  for (max=i=0; ++i <= n0; )
+    if (_->fds[i] > max)
+      max	= _->fds[i];
+  for (i=0; ++i <= n0; )
+    if (_->recfds[i] != _->fds[i] && _->recfds[i] <= max)
+      {
+        int	fd;
+
+        fd	= fcntl(_->recfds[i], F_DUPFD_CLOEXEC, max+1);
+        if (fd<0)
+          PFD_OOPS(_, "cannot move FD %d", _->recfds[i]);
+        close(_->recfds[i]);
+        _->recfds[i]	= fd;
+      }
+
   for (i=0; ++i <= n0; )
     {
       int	fd0 = _->fds[i];
@@ -530,11 +2208,17 @@ P(map, int)
       if (fd0 != fd1)
         {
           dup2(fd1, fd0);
-          snprintf(where, sizeof where, "(mapped to %d)", fd0);
+          PFD_T(_, DUP2, fd0, fd1);
+          strcpy(where, "(mapped)");
+          if (_->verbose)	/* no printf on the quiet path	*/
+            snprintf(where, sizeof where, "(mapped to %d)", fd0);
           PFD_close(_, fd1, where);
           _->recfds[i]	= fd0;
         }
+      else
+        PFD_cloexec(_, fd0, 1);	/* already in place	*/
     }
+  PFD_PROBE(map, n0, PFD_PROBE_NS(t0));
   return fd2;
 }
 
@@ -599,25 +2283,45 @@ P(exec, void, int dofork, int fd)
     return;
   _->done	= 1;
 
-  if (dofork<0)
+  if (dofork<0 && fd>=0)
     {
       /* forking is done after socket established
-       * on d: pass the socket
+       * on d: pass the socket (fd<0: ->recfds already set)
        * all others: cannot happen
        *
        * So prepare ->recfds[] here for parent and child
        */
-      int	*fds;
+      int	*fds = 0;
 
-      fds	= PFD_alloc(_, 2*sizeof (*fds));
-      fds[0]	= 1;
-      fds[1]	= fd;
+      PFD_ints_add(_, &fds, fd);
       PFD_recfds(_, fds);
     }
 
   if (!_->cmd)
     return;
 
+  /* f f on a retry: the command still expects the socketpair	*/
+  if (dofork<0 && _->speculate && !_->spec_pid)
+    PFD_speculate(_);
+  if (dofork<0 && _->spec_pid)
+    {
+      /* f f: command already runs, see PFD_speculate()	*/
+      pid_t	pid = _->spec_pid;
+      uint64_t	m0;
+
+      _->spec_pid	= 0;
+      if (PFD_sendfd_try(_, _->spec, _->recfds, NULL, PFD_MSG_NOSIGNAL))
+        PFD_V(_, "speculative %d did not take the FDs", (int)pid);
+      close(_->spec);
+      PFD_V(_, "running %d: %s", (int)pid, _->cmd[0]);
+      if (PFD_supervise(_, pid))
+        return;
+      m0	= PFD_M0(_);
+      PFD_waitpid(_, pid);
+      PFD_M(_, CHILD, m0);
+      return;
+    }
+
   if (dofork)
     {
       /* forking is done before we have received FDs
@@ -631,6 +2335,14 @@ P(exec, void, int dofork, int fd)
       pid	= fork();
       if (pid == (pid_t)-1)
         PFD_OOPS(_, "fork() failed");
+      if (!pid && _->trace)
+        _->trace->count	= 0;	/* parent flushes what happened before	*/
+      if (!pid)
+        PFD_metrics_forked(_);
+      else
+        PFD_MC(_, forks, 1);
+      PFD_T(_, FORK, 0, (int)pid);
+      PFD_PROBE(exec, _->cmd[0], dofork, (int)pid);
       if (dofork>0)
         {
           if (!pid)
@@ -642,8 +2354,14 @@ P(exec, void, int dofork, int fd)
         }
       else if (pid)
         {
+          uint64_t	m0;
+
           PFD_V(_, "running %d: %s", (int)pid, _->cmd[0]);
+          if (PFD_supervise(_, pid))
+            return;
+          m0	= PFD_M0(_);
           PFD_waitpid(_, pid);
+          PFD_M(_, CHILD, m0);
           return;
         }
     }
@@ -656,14 +2374,61 @@ P(exec, void, int dofork, int fd)
        * on p: pass the received FDs as listed
        */
       if (_->recfds)
-        PFD_map(_);
+        {
+          PFD_map(_);
+          PFD_fdnames(_);
+        }
       PFD_V(_, "exec %s", _->cmd[0]);
     }
 
+  PFD_T(_, EXEC, 0, 0);
+  PFD_PROBE(exec, _->cmd[0], 0, 0);
+  PFD_trace_flush(_);
+  PFD_metrics_emit(_, "exec");
   execvp(_->cmd[0], _->cmd);
   PFD_OOPS(_, "exec failure: %s", _->cmd[0]);
 }
 
+/* f f: start the command before connecting.
+ * It gets a socketpair() instead of the socket (on the first FD),
+ * the socket follows on it as soon as it is connected (see PFD_exec()),
+ * so its startup runs in parallel to the connect.
+ * If the command fails, a retry starts it the same way again,
+ * but only after the connect.
+ */
+P(speculate, void)
+{
+  int	sp[2], *fds;
+  pid_t	pid;
+
+  if (socketpair(AF_UNIX, SOCK_STREAM, 0, sp))
+    PFD_OOPS(_, "socketpair() error");
+  PFD_cloexec(_, sp[0], 0);
+
+  pid	= fork();
+  if (pid == (pid_t)-1)
+    PFD_OOPS(_, "fork() failed");
+  PFD_T(_, FORK, 0, (int)pid);
+  if (!pid)
+    {
+      if (_->trace)
+        _->trace->count	= 0;
+      PFD_metrics_forked(_);
+      close(sp[0]);
+      fds	= 0;
+      PFD_ints_add(_, &fds, sp[1]);
+      PFD_recfds(_, fds);
+      _->done	= 0;	/* a retry comes here from PFD_exec()	*/
+      PFD_exec(_, 0, -1);
+    }
+  PFD_MC(_, forks, 1);
+  PFD_PROBE(exec, _->cmd[0], -1, (int)pid);
+  PFD_V(_, "speculative %d: %s", (int)pid, _->cmd[0]);
+  close(sp[1]);
+  _->spec	= sp[0];
+  _->spec_pid	= pid;
+}
+
 P(fork, void)
 {
   if (!_->dofork)
@@ -686,6 +2451,167 @@ P(fork, void)
 }
 
 
+/***********************************************************************
+ * Rendezvous without filesystem: socket @ and option n
+ **********************************************************************/
+
+/* 2*len random hex digits (and NUL)
+ */
+P(random_hex, void, char *buf, size_t len)
+{
+  unsigned char	r[64];
+  size_t	i;
+  int		fd;
+
+  if (len > sizeof r)
+    PFD_INTERNAL("random too long: %d", (int)len);
+  fd	= open("/dev/urandom", O_RDONLY|O_CLOEXEC);
+  if (fd<0 || read(fd, r, len) != (ssize_t)len)
+    PFD_OOPS(_, "cannot read /dev/urandom");
+  close(fd);
+  for (i=0; i<len; i++)
+    snprintf(buf+2*i, 3, "%02x", r[i]);
+}
+
+#define	PFD_NONCE_MAX	255
+
+/* n: use PASSFD_NONCE, create it if unset or empty
+ */
+P(nonce_init, void)
+{
+  const char	*s;
+  char		buf[33];
+
+  s	= getenv("PASSFD_NONCE");
+  if (!s || !*s)
+    {
+      PFD_random_hex(_, buf, 16);
+      PFD_setenv(_, "PASSFD_NONCE", buf);
+      s	= buf;
+    }
+  if (strlen(s) > PFD_NONCE_MAX)
+    PFD_OOPS(_, "PASSFD_NONCE too long, max %d", PFD_NONCE_MAX);
+  _->nonce	= PFD_dup(_, s);
+}
+
+/* Connecting side: send the nonce (length byte, nonce)
+ */
+P(nonce_send, void, int fd)
+{
+  unsigned char	buf[1+PFD_NONCE_MAX];
+  size_t	len;
+
+  len	= strlen(_->nonce);
+  buf[0]	= len;
+  memcpy(buf+1, _->nonce, len);
+  if (send(fd, buf, len+1, PFD_MSG_NOSIGNAL) != (ssize_t)len+1)
+    PFD_OOPS(_, "cannot send nonce to %d", fd);
+}
+
+/* Accepting side: returns 0 if the peer sent the right nonce
+ */
+P(nonce_check, int, int fd)
+{
+  unsigned char	buf[1+PFD_NONCE_MAX], d;
+  size_t	len, got;
+  ssize_t	n;
+
+  len	= strlen(_->nonce);
+  for (got=0; got < len+1; got += n)
+    {
+      PFD_poll(_, fd, POLLIN);	/* obey timeout	*/
+      n	= recv(fd, buf+got, len+1-got, MSG_DONTWAIT);
+      if (n<0 && errno == EINTR)
+        n	= 0;
+      else if (n<=0 || buf[0] != len)
+        break;
+    }
+  if (got < len+1)
+    {
+      PFD_E(_, "nonce not received on %d", fd);
+      return 1;
+    }
+  for (d=0; len; len--)		/* compare in constant time	*/
+    d	|= buf[len] ^ (unsigned char)_->nonce[len-1];
+  if (d)
+    PFD_E(_, "wrong nonce on %d", fd);
+  return d != 0;
+}
+
+/* Nonce check of a relay stream, which must not block the others
+ */
+struct PFD_nonce
+  {
+    uint64_t		due;	/* ns: deadline, 0 when checked	*/
+    size_t		got;	/* bytes received so far	*/
+    unsigned char	d;	/* differences seen	*/
+  };
+
+/* returns -1 while incomplete, 0 if ok, else 1
+ */
+P(nonce_more, int, int fd, struct PFD_nonce *s)
+{
+  unsigned char	buf[1+PFD_NONCE_MAX];
+  size_t	len, i;
+  ssize_t	n;
+
+  len	= strlen(_->nonce);
+  n	= recv(fd, buf, len+1-s->got, MSG_DONTWAIT);
+  if (n<0 && (errno == EINTR || errno == EAGAIN || errno == EWOULDBLOCK))
+    return -1;
+  if (n<=0)
+    {
+      PFD_E(_, "nonce not received on %d", fd);
+      return 1;
+    }
+  for (i=0; i<(size_t)n; i++, s->got++)	/* compare in constant time	*/
+    s->d	|= buf[i] ^ (s->got ? (unsigned char)_->nonce[s->got-1] : (unsigned char)len);
+  if (s->got < len+1)
+    return -1;
+  if (s->d)
+    PFD_E(_, "wrong nonce on %d", fd);
+  return s->d != 0;
+}
+
+/* Each dialer calls this after a successful connect()
+ * (connect_sock, fan-in and PASSFD_SUPERVISOR, d with several destinations).
+ * TCP peers are no passfd, so they get no nonce.
+ */
+P(connected, void, int fd, int family)
+{
+  if (_->nonce && family == AF_UNIX)
+    PFD_nonce_send(_, fd);
+}
+
+/* Socket @ alone: the creating side makes up a random abstract name
+ * and exports it as PASSFD_SOCK, the other side uses PASSFD_SOCK.
+ * So there is nothing in the filesystem.
+ */
+P(rendezvous, void, int create)
+{
+  char		name[64];
+  const char	*s;
+
+  if (strcmp(_->sockname, "@"))
+    return;
+  if (!(_->accept || _->listen || (!_->connect && create>0)))
+    {
+      s	= getenv("PASSFD_SOCK");
+      if (!s || !*s)
+        PFD_OOPS(_, "socket @ needs PASSFD_SOCK");
+      PFD_sockname(_, s);
+      return;
+    }
+#ifndef	__linux__
+  PFD_OOPS(_, "socket @ needs abstract Unix Domain Sockets (Linux)");
+#endif
+  snprintf(name, sizeof name, "@passfd-%ld-", (long)getpid());
+  PFD_random_hex(_, name+strlen(name), 8);
+  PFD_sockname(_, name);
+  PFD_setenv(_, "PASSFD_SOCK", name);
+}
+
+
 /***********************************************************************
  * Socket functions
  **********************************************************************/
@@ -719,12 +2645,15 @@ P(retry, int, struct PFD_retry *r)
 
   if (r->ms)
     {
-      unsigned u;
+      unsigned	u;
+      uint64_t	m0;
 
       u	= r->ms;			/* r->ms<0 gives 128s	*/
       if (u > 128000)
         u	= 128000;		/* capped at 128s	*/
+      PFD_PROBE(retry, r->count, u, r->total);
       PFD_V(_, "sleep %ums (total %u)", u, r->total);
+      m0	= PFD_M0(_);
 
       /* usleep() cannot sleep more than 1s	*/
       if (u >= 1000)
@@ -732,6 +2661,9 @@ P(retry, int, struct PFD_retry *r)
       if (u % 1000)
         usleep(1000 * (u % 1000));	/* ignore EINTR	*/
 
+      PFD_M(_, RETRY_SLEEP, m0);
+      PFD_MC(_, sleeps, 1);
+
       r->total	+= u;
     }
   else
@@ -752,6 +2684,7 @@ P(retry, int, struct PFD_retry *r)
     PFD_V(_, "retry %u of %d", r->count, _->retry);
 
   r->count++;	/* increment here, because "retry 1 of 0" looks too wrong	*/
+  PFD_MC(_, retries, 1);
   PFD_retry_init(_, r);
   return 0;
 }
@@ -802,9 +2735,11 @@ P(bind_un, int, struct sockaddr_un *un, socklen_t max)
   if (!bind(_->sock, (struct sockaddr *)un, max) &&
       (!_->bound_un || !lstat(_->sockname, &_->creation)))
     {
+      PFD_T(_, BIND, _->sock, 0);
       PFD_V(_, "bind %d: %s", _->sock, _->sockname);
       return 0;
     }
+  PFD_T(_, BIND, -1, _->sock);
   if (errno != EADDRINUSE)
     PFD_OOPS(_, "cannot bind to socket address: %s", _->sockname);
 
@@ -829,10 +2764,11 @@ P(listen, void)
 P(accept, void, struct sockaddr_un *un, socklen_t max, int create)
 {
   struct PFD_retry	retry = {0};
+  uint64_t		t0, m0;
 
   if (un)
     {
-      PFD_sock(_, socket(un->sun_family, SOCK_STREAM, 0));
+      PFD_sock(_, PFD_socket(_, un->sun_family, SOCK_STREAM));
       PFD_cloexec(_, _->sock, 0);
     }
   do
@@ -847,11 +2783,27 @@ P(accept, void, struct sockaddr_un *un, socklen_t max, int create)
       PFD_listen(_);
       if (create>=0)
         PFD_fork(_);
+      if (_->relay)
+        {
+          PFD_nonblock(_, _->sock);
+          return;		/* accepts itself, see PFD_relay()	*/
+        }
 
       PFD_nonblock(_, _->sock);
       PFD_V(_, "accept %d: %s", _->sock, _->sockname);
-      PFD_poll(_, _->sock, POLLIN);
-      fd	= accept(_->sock, NULL, NULL);
+      for (;;)
+        {
+          t0	= PFD_PROBE_T0(accept);
+          m0	= PFD_M0(_);
+          PFD_poll(_, _->sock, POLLIN);
+          fd	= accept(_->sock, NULL, NULL);
+          PFD_M(_, ACCEPT_WAIT, m0);
+          PFD_T(_, ACCEPT, fd, _->sock);
+          PFD_PROBE(accept, _->sock, fd, _->sockname, PFD_PROBE_NS(t0));
+          if (fd<0 || !_->nonce || !PFD_nonce_check(_, fd))
+            break;
+          close(fd);	/* wrong nonce: wait for the next one	*/
+        }
       if (fd<0)
         {
           if (errno == EINTR || errno==EAGAIN || errno==EWOULDBLOCK)
@@ -859,6 +2811,7 @@ P(accept, void, struct sockaddr_un *un, socklen_t max, int create)
           break;
         }
       PFD_V(_, "accepted %d", fd);
+      PFD_MC(_, accepts, 1);
       if (create<0)
         {
           PFD_exec(_, -1, fd);
@@ -877,11 +2830,19 @@ P(accept, void, struct sockaddr_un *un, socklen_t max, int create)
 
 P(connect_sock, int, struct sockaddr *sa, socklen_t max, struct sockaddr *bind, socklen_t bindlen, int create)
 {
+  uint64_t	t0, m0;
+
   /* TODO XXX TODO: bind
    */
+  t0	= PFD_PROBE_T0(connect);
+  m0	= PFD_M0(_);
+  _->connect_ns	= 0;
   if (sa)
     {
-      PFD_sock(_, socket(sa->sa_family, SOCK_STREAM, 0));
+      uint64_t	c0;
+
+      c0	= PFD_ns(_);
+      PFD_sock(_, PFD_socket(_, sa->sa_family, SOCK_STREAM));
       PFD_cloexec(_, _->sock, 0);
 
       PFD_nonblock(_, _->sock);
@@ -890,6 +2851,7 @@ P(connect_sock, int, struct sockaddr *sa, socklen_t max, struct sockaddr *bind,
           int	err;
           socklen_t	len;
 
+          PFD_T(_, CONNECT, -1, _->sock);
           if (errno != EINPROGRESS && errno != EALREADY)
             goto fail;
 
@@ -899,14 +2861,30 @@ P(connect_sock, int, struct sockaddr *sa, socklen_t max, struct sockaddr *bind,
           PFD_poll(_, _->sock, POLLOUT);	/* obey timeout	*/
 
           len	= sizeof(err);
-          if (PFD_R(_, getsockopt(_->sock, SOL_SOCKET, SO_ERROR, &err, &len) || err, "connect %d: %s", _->sock, _->sockname))
+          if (PFD_R(_, getsockopt(_->sock, SOL_SOCKET, SO_ERROR, &err, &len) || (errno = err), "connect %d: %s", _->sock, _->sockname))
             goto fail;
         }
+      _->connect_ns	= PFD_ns(_) - c0;
       PFD_blocking(_, _->sock);
+      PFD_T(_, CONNECT, _->sock, 0);
     }
+  PFD_PROBE(connect, _->sock, _->sockname, 0, PFD_PROBE_NS(t0));
+  PFD_M(_, CONNECT, m0);
+  PFD_MC(_, connects, 1);
 
   _->done	= 0;
   PFD_V(_, "connected to %s", _->sockname);
+#ifdef	MPTCP_INFO
+  /* optlen 0 only checks for fallback to TCP	*/
+  if (_->mptcp && _->verbose && sa && sa->sa_family != AF_UNIX)
+    {
+      socklen_t	len = 0;
+
+      PFD_V(_, "connection %d: %s", _->sock, getsockopt(_->sock, SOL_MPTCP, MPTCP_INFO, NULL, &len) ? "TCP" : "MPTCP");
+    }
+#endif
+  if (sa)
+    PFD_connected(_, _->sock, sa->sa_family);
   if (create>=0)
     {
       PFD_fork(_);
@@ -916,6 +2894,9 @@ P(connect_sock, int, struct sockaddr *sa, socklen_t max, struct sockaddr *bind,
   return _->ret;
 
 fail:
+  PFD_PROBE(connect, _->sock, _->sockname, 1, PFD_PROBE_NS(t0));
+  PFD_M(_, CONNECT, m0);
+  PFD_MC(_, connect_fails, 1);
   PFD_V(_, "failed to connect %d to %s", _->sock, _->sockname);
   PFD_close(_, _->sock, _->sockname);
   return 1;
@@ -990,25 +2971,31 @@ P(open_nr, void, int create)
 
 /* Open a socket given as Unix Domain Socket path
  */
-P(open_unix, void, int create)
+P(sun, socklen_t, struct sockaddr_un *sun)
 {
-  struct sockaddr_un	sun;
   int			max;
 
   max			= strlen(_->sockname);
-  if (max > (int)sizeof(sun.sun_path))
+  if (max > (int)sizeof(sun->sun_path))
     PFD_OOPS(_, "socket path too long: %s", _->sockname);
 
-  sun.sun_family	= AF_UNIX;
+  sun->sun_family	= AF_UNIX;
 #pragma GCC diagnostic push
 #pragma GCC diagnostic ignored "-Wstringop-truncation"
-  strncpy(sun.sun_path, _->sockname, sizeof(sun.sun_path));
+  strncpy(sun->sun_path, _->sockname, sizeof(sun->sun_path));
 #pragma GCC diagnostic pop
   if (_->sockname[0]=='@')
-    sun.sun_path[0]     = 0;    /* Abstract Linux Socket        */
+    sun->sun_path[0]    = 0;    /* Abstract Linux Socket        */
+
+  return max + offsetof(struct sockaddr_un, sun_path);
+}
 
-  max		+= offsetof(struct sockaddr_un, sun_path);
+P(open_unix, void, int create)
+{
+  struct sockaddr_un	sun;
+  socklen_t		max;
 
+  max	= PFD_sun(_, &sun);
   PFD_acceptconnect(_, &sun, max, create);
 }
 
@@ -1037,20 +3024,24 @@ P(addr_free, void, struct PFD_addr *a)
   PFD_free(_, a->host);
   PFD_free(_, a->port);
   if (a->ai)
-    freeaddrinfo(a->ai);
+    PFD_freeaddrinfo(_, a->ai);
   memset(a, 0, sizeof *a);
 }
 
 P(addr_first, struct addrinfo *, struct PFD_addr *a)
 {
-  int	err;
+  int		err;
+  uint64_t	m0;
 
   if (a->ai)
-    freeaddrinfo(a->ai);
+    PFD_freeaddrinfo(_, a->ai);
   a->ai	= 0;
   a->pos= 0;
 
-  if ((err = getaddrinfo(a->host, a->port, NULL, &a->ai)) != 0)
+  m0	= PFD_M0(_);
+  err	= PFD_getaddrinfo(_, a->host, a->port, NULL, &a->ai);
+  PFD_M(_, RESOLVE, m0);
+  if (err)
     return 0;
   return a->pos = a->ai;
 }
@@ -1060,53 +3051,500 @@ P(addr_next, struct addrinfo *, struct PFD_addr *a)
   return a->pos = a->pos->ai_next;
 }
 
-P(open_tcp_connect, int, struct PFD_addr *dest, struct addrinfo *bind, int create)
+/* Backend selection for d
+ *
+ * All addresses of [host]:port|[host]:port.. are backends.
+ * They are tried in the order of the connect time seen before plus
+ * a penalty for failures, which are kept in $PASSFD_RTTCACHE.
+ * With 'g' the first one tried is the better of two random ones.
+ */
+#define	PFD_RTT_PENALTY	200000	/* us per failure	*/
+#define	PFD_RTT_MAX	1024	/* entries in cache	*/
+
+struct PFD_rtt
+  {
+    char		key[INET6_ADDRSTRLEN+8];	/* numeric host:port	*/
+    unsigned long	us;	/* smoothed connect time, 0 if unknown	*/
+    unsigned		fails;	/* in a row	*/
+  };
+
+struct PFD_backend
+  {
+    struct addrinfo	*ai;
+    struct PFD_rtt	*rtt;
+  };
+
+struct PFD_rttcache
+  {
+    const char		*file;		/* NULL if off	*/
+    int			n;
+    struct PFD_rtt	e[PFD_RTT_MAX];
+  };
+
+P(rtt_find, struct PFD_rtt *, struct PFD_rttcache *c, struct addrinfo *ai)
+{
+  char		host[INET6_ADDRSTRLEN], port[8], key[sizeof c->e[0].key];
+  int		i;
+
+  if (getnameinfo(ai->ai_addr, ai->ai_addrlen, host, sizeof host, port, sizeof port, NI_NUMERICHOST|NI_NUMERICSERV))
+    return 0;
+  snprintf(key, sizeof key, strchr(host, ':') ? "[%s]:%s" : "%s:%s", host, port);
+  for (i=0; i<c->n; i++)
+    if (!strcmp(c->e[i].key, key))
+      return &c->e[i];
+  if (c->n >= PFD_RTT_MAX)
+    i	= random() % PFD_RTT_MAX;	/* forget some	*/
+  else
+    i	= c->n++;
+  memcpy(c->e[i].key, key, sizeof key);
+  c->e[i].us	= 0;
+  c->e[i].fails	= 0;
+  return &c->e[i];
+}
+
+#define	PFD_RTT_LINE	80	/* key us fails	*/
+
+P(rtt_load, void, struct PFD_rttcache *c)
+{
+  char	*buf, *line, *x;
+
+  c->n		= 0;
+  c->file	= getenv("PASSFD_RTTCACHE");
+  if (!c->file || !*c->file)
+    return;
+  buf	= PFD_alloc(_, PFD_RTT_MAX * PFD_RTT_LINE);
+  if (PFD_readfile(_, c->file, buf, PFD_RTT_MAX * PFD_RTT_LINE)>0)
+    for (line=strtok_r(buf, "\n", &x); line && c->n < PFD_RTT_MAX; line=strtok_r(NULL, "\n", &x))
+      {
+        struct PFD_rtt	*e = &c->e[c->n];
+
+        if (sscanf(line, "%53s %lu %u", e->key, &e->us, &e->fails) == 3)
+          c->n++;
+      }
+  PFD_free(_, buf);
+}
+
+/* write to a temporary file and rename(), so readers never see half a file
+ *
+ * Load and save are not locked: of concurrent d runs the last one wins,
+ * updates of the others are lost.  This is fine for a cache.
+ */
+P(rtt_save, void, struct PFD_rttcache *c)
+{
+  char		tmp[PATH_MAX], *buf;
+  size_t	len;
+  int		fd, i, ok;
+
+  if (!c->file || !*c->file)
+    return;
+  tmp[0]	= 0;
+  PFD_append(_, tmp, sizeof tmp, "%s.%ld", c->file, (long)getpid());
+  if ((fd = open(tmp, O_WRONLY|O_CREAT|O_TRUNC|O_CLOEXEC, 0666))<0)
+    {
+      PFD_E(_, "cannot write %s", tmp);
+      return;
+    }
+  buf		= PFD_alloc(_, PFD_RTT_MAX * PFD_RTT_LINE);
+  buf[0]	= 0;
+  for (i=0; i<c->n; i++)
+    PFD_append(_, buf, PFD_RTT_MAX * PFD_RTT_LINE, "%s %lu %u\n", c->e[i].key, c->e[i].us, c->e[i].fails);
+  len	= strlen(buf);
+  ok	= write(fd, buf, len) == (ssize_t)len;
+  PFD_free(_, buf);
+  if (close(fd) || !ok || rename(tmp, c->file))
+    {
+      PFD_E(_, "cannot write %s", c->file);
+      unlink(tmp);
+    }
+}
+
+P(rtt_score, unsigned long, struct PFD_rtt *r)
+{
+  if (!r)
+    return 0;
+  return r->us + (r->fails < 10 ? r->fails : 10) * (unsigned long)PFD_RTT_PENALTY;
+}
+
+/* for mergesort(), which is stable, so equal scores keep resolver order
+ */
+P(bcmp, int, int a, int b)
+{
+  unsigned long	x, y;
+
+  x	= PFD_rtt_score(_, _->backend[a].rtt);
+  y	= PFD_rtt_score(_, _->backend[b].rtt);
+  return x<y ? -1 : x>y;
+}
+
+P(bswap, void, int a, int b)
+{
+  struct PFD_backend	tmp;
+
+  tmp			= _->backend[a];
+  _->backend[a]		= _->backend[b];
+  _->backend[b]		= tmp;
+}
+
+/* Sort backends, with 'g' move the better of two random ones first
+ */
+P(backend_order, void, int n)
+{
+  int	a, b;
+
+  if (n<2)
+    return;
+  mergesort(_, n, PFD_bcmp, PFD_bswap, PFD_alloc, PFD_free);
+  if (!_->gamble)
+    return;
+  a	= random() % n;
+  b	= random() % (n-1);
+  if (b >= a)
+    b++;
+  if (PFD_bcmp(_, a, b) > 0)
+    a	= b;
+  for (; a>0; a--)
+    PFD_bswap(_, a, a-1);
+}
+
+P(open_tcp_connect, int, struct PFD_addr *dest, int n, struct PFD_addr *bind, struct PFD_rttcache *c, int create)
 {
   struct addrinfo	*ai;
+  int			i, k, ret;
+
+  for (k=i=0; i<n; i++)
+    for (ai=PFD_addr_first(_, &dest[i]); ai; ai=PFD_addr_next(_, &dest[i]))
+      k++;
+  _->backend	= PFD_realloc(_, _->backend, (k+1) * sizeof *_->backend);
+  for (k=i=0; i<n; i++)
+    for (ai=dest[i].ai; ai; ai=ai->ai_next, k++)
+      {
+        _->backend[k].ai	= ai;
+        _->backend[k].rtt	= c->file ? PFD_rtt_find(_, c, ai) : 0;
+      }
+  PFD_backend_order(_, k);
 
-  for (ai=PFD_addr_first(_, dest); ai; ai=PFD_addr_next(_, dest))
-    if (!PFD_connect_sock(_, ai->ai_addr, ai->ai_addrlen, bind ? bind->ai_addr : NULL, bind ? bind->ai_addrlen : 0, create))
-      return 0;
+  for (ret=1, i=0; ret && i<k; i++)
+    {
+      struct PFD_backend	*b = &_->backend[i];
+
+      if (b->rtt)
+        PFD_V(_, "backend %s: %luus %u fails", b->rtt->key, b->rtt->us, b->rtt->fails);
+      if (bind && bind->host && bind->host[0])
+        {
+          struct addrinfo	*ba;
+
+          for (ba=PFD_addr_first(_, bind); ret && ba; ba=PFD_addr_next(_, bind))
+            ret	= PFD_connect_sock(_, b->ai->ai_addr, b->ai->ai_addrlen, ba->ai_addr, ba->ai_addrlen, create);
+        }
+      else
+        ret	= PFD_connect_sock(_, b->ai->ai_addr, b->ai->ai_addrlen, NULL, 0, create);
+
+      if (!b->rtt)
+        continue;
+      if (_->connect_ns)
+        {
+          unsigned long	us = _->connect_ns / 1000;
+
+          b->rtt->us	= b->rtt->us ? (3*b->rtt->us + us) / 4 : us ? us : 1;
+          b->rtt->fails	= 0;
+        }
+      else
+        b->rtt->fails++;
+    }
+  i	= errno;	/* keep the connect error for PFD_OOPS	*/
+  PFD_rtt_save(_, c);
+  errno	= i;
+  return ret;
+}
+
+
+P(open_tcp, void, int create)
+{
+  struct PFD_retry	retry = {0};
+  struct PFD_rttcache	*cache;
+  char			*name, *tmp, *x;
+  struct PFD_addr	bind = {0}, *dest;
+  int			n;
+
+  name	= PFD_dup(_, _->sockname);
+
+  /* [host]:port|[host]:port..[@bind]	*/
+  if ((tmp = strchr(name, '@'))!=0)
+    {
+      *tmp++	= 0;
+      PFD_addr(_, &bind, tmp);
+    }
+  dest	= PFD_alloc(_, (strlen(name)+1) * sizeof *dest);
+  n	= 0;
+  for (tmp=strtok_r(name, "|", &x); tmp; tmp=strtok_r(NULL, "|", &x))
+    {
+      memset(&dest[n], 0, sizeof *dest);
+      PFD_addr(_, &dest[n++], tmp);
+    }
+  PFD_free(_, name);
+  if (!n)
+    PFD_OOPS(_, "missing destination: %s", _->sockname);
+
+  cache	= PFD_alloc(_, sizeof *cache);
+  PFD_rtt_load(_, cache);
+  srandom((unsigned)(getpid() ^ PFD_ns(_)));
+
+  while (PFD_open_tcp_connect(_, dest, n, &bind, cache, create))
+    if (PFD_retry(_, &retry))
+      PFD_OOPS(_, "open_tcp() error: %s", _->sockname);
+
+  PFD_addr_free(_, &bind);
+  while (n)
+    PFD_addr_free(_, &dest[--n]);
+  PFD_free(_, dest);
+  PFD_free(_, cache);
+}
+
+/* Multiple destinations for d: dial all of them in parallel
+ */
+struct PFD_dial
+  {
+    const char		*name;
+    struct PFD_addr	addr;
+    struct PFD_addr	bind;	/* [host][:port] after @, if any	*/
+    struct addrinfo	un;	/* for Unix Domain Sockets	*/
+    struct sockaddr_un	sun;
+    struct addrinfo	*ai;	/* address being tried	*/
+    int			fd;	/* -1 if not connected	*/
+    int			busy;	/* connect() in progress	*/
+    int			err;	/* last error	*/
+  };
+
+/* bind() the socket of d to the first local address of its family
+ * returns 0 if bound (or nothing to bind)
+ */
+P(dial_bind, int, struct PFD_dial *d)
+{
+  struct addrinfo	*ba;
+
+  if (!d->bind.host || !d->bind.host[0])
+    return 0;
+  d->err	= EADDRNOTAVAIL;	/* if no address of this family	*/
+  for (ba=PFD_addr_first(_, &d->bind); ba; ba=PFD_addr_next(_, &d->bind))
+    {
+      if (ba->ai_family != d->ai->ai_family)
+        continue;
+      if (!bind(d->fd, ba->ai_addr, ba->ai_addrlen))
+        {
+          PFD_V(_, "bind %d: %s", d->fd, d->name);
+          return 0;
+        }
+      d->err	= errno;
+    }
+  return 1;
+}
+
+/* Start connect() to the next address of d
+ * returns 0 if connect() is in progress or done
+ */
+P(dial_next, int, struct PFD_dial *d)
+{
+  for (; d->ai; d->ai=d->ai->ai_next)
+    {
+      d->fd	= PFD_socket(_, d->ai->ai_family, SOCK_STREAM);
+      if (d->fd<0)
+        continue;
+      PFD_cloexec(_, d->fd, 0);
+      if (PFD_dial_bind(_, d))
+        {
+          close(d->fd);
+          d->fd	= -1;
+          continue;
+        }
+      PFD_nonblock(_, d->fd);
+      d->busy	= 1;
+      if (!connect(d->fd, d->ai->ai_addr, d->ai->ai_addrlen) || errno == EINPROGRESS)
+        return 0;
+      d->err	= errno;
+      PFD_T(_, CONNECT, -1, d->fd);
+      PFD_MC(_, connect_fails, 1);
+      close(d->fd);
+      d->fd	= -1;
+      d->busy	= 0;
+    }
   return 1;
 }
 
+/* One round: dial all unconnected destinations in parallel
+ * returns the number of unconnected destinations
+ */
+P(dial, int, struct PFD_dial *d, int n)
+{
+  struct pollfd	*pfd;
+  uint64_t	end, m0;
+  int		i, left;
+
+  m0	= PFD_M0(_);
+  pfd	= PFD_alloc(_, n * sizeof *pfd);
+  for (left=i=0; i<n; i++)
+    {
+      pfd[i].fd		= -1;
+      pfd[i].events	= POLLOUT;
+      if (d[i].fd>=0)
+        continue;
+      d[i].ai	= d[i].un.ai_addr ? &d[i].un : PFD_addr_first(_, &d[i].addr);
+      d[i].err	= EHOSTUNREACH;		/* if it does not resolve	*/
+      if (!PFD_dial_next(_, &d[i]))
+        pfd[i].fd	= d[i].fd;
+      left++;
+    }
+
+  end	= PFD_ns(_) + (_->timeout ? _->timeout : 10000) * 1000000ull;
+  for (;;)
+    {
+      uint64_t	now;
+      int	busy;
+
+      for (busy=i=0; i<n; i++)
+        busy	+= d[i].busy;
+      now	= PFD_ns(_);
+      if (!busy || now >= end)
+        break;
+      if (poll(pfd, (nfds_t)n, (int)((end - now + 999999) / 1000000))<0 && errno != EINTR)
+        PFD_OOPS(_, "poll() error");
+      for (i=0; i<n; i++)
+        {
+          int		err;
+          socklen_t	len;
+
+          if (!d[i].busy || !pfd[i].revents)
+            continue;
+          len	= sizeof err;
+          d[i].busy	= 0;
+          if (!getsockopt(d[i].fd, SOL_SOCKET, SO_ERROR, &err, &len) && !err)
+            {
+              PFD_blocking(_, d[i].fd);
+              PFD_T(_, CONNECT, d[i].fd, 0);
+              PFD_MC(_, connects, 1);
+              PFD_V(_, "connected %d to %s", d[i].fd, d[i].name);
+              PFD_connected(_, d[i].fd, d[i].ai->ai_family);
+              pfd[i].fd	= -1;
+              left--;
+              continue;
+            }
+          d[i].err	= err ? err : errno;
+          PFD_T(_, CONNECT, -1, d[i].fd);
+          PFD_MC(_, connect_fails, 1);
+          close(d[i].fd);
+          d[i].fd	= -1;
+          d[i].ai	= d[i].ai->ai_next;
+          pfd[i].fd	= PFD_dial_next(_, &d[i]) ? -1 : d[i].fd;
+        }
+    }
+
+  /* timeout	*/
+  for (i=0; i<n; i++)
+    if (d[i].busy)
+      {
+        PFD_V(_, "timeout connecting to %s", d[i].name);
+        d[i].err	= ETIMEDOUT;
+        close(d[i].fd);
+        d[i].fd		= -1;
+        d[i].busy	= 0;
+      }
+  PFD_M(_, CONNECT, m0);
+  PFD_free(_, pfd);
+  return left;
+}
 
-P(open_tcp, void, int create)
+/* d with a comma separated list of [host]:port[@bind]
+ *
+ * All are dialed in parallel, failing ones are retried together.
+ * The sockets are passed in one message, and mapped to consecutive
+ * FDs (after the last one given) for the command.
+ */
+P(open_multi, void)
 {
   struct PFD_retry	retry = {0};
-  char			*name, *tmp;
-  struct PFD_addr	bind = {0}, dest = {0};
+  struct PFD_dial	*d;
+  char			*names, *tmp, *x;
+  int			n, i;
 
-  name	= PFD_dup(_, _->sockname);
-
-  /* [host]:port[@bind]	*/
-  if ((tmp = strchr(name, '@'))!=0)
+  names	= PFD_dup(_, _->sockname);
+  d	= PFD_alloc(_, (strlen(names)+1) * sizeof *d);
+  n	= 0;
+  for (tmp=strtok_r(names, ",", &x); tmp; tmp=strtok_r(NULL, ",", &x))
     {
-      *tmp++	= 0;
-      PFD_addr(_, &bind, tmp);
+      memset(&d[n], 0, sizeof *d);
+      d[n].fd	= -1;
+      d[n].name	= tmp;
+      if (strchr("@/.", *tmp))
+        {
+          const char	*save;
+
+          save			= _->sockname;
+          _->sockname		= tmp;
+          d[n].un.ai_family	= AF_UNIX;
+          d[n].un.ai_addrlen	= PFD_sun(_, &d[n].sun);
+          d[n].un.ai_addr	= (struct sockaddr *)&d[n].sun;
+          _->sockname		= save;
+        }
+      else
+        {
+          char	*name, *at;
+
+          name	= PFD_dup(_, tmp);
+          if ((at = strchr(name, '@'))!=0)
+            {
+              *at++	= 0;
+              PFD_addr(_, &d[n].bind, at);
+            }
+          PFD_addr(_, &d[n].addr, name);
+          PFD_free(_, name);
+        }
+      n++;
     }
-  PFD_addr(_, &dest, name);
-  PFD_free(_, name);
 
-  do
+  /* consecutive FDs for the command	*/
+  if (_->fds && _->fds[0] && _->fds[0] < n)
+    while (_->fds[0] < n)
+      PFD_ints_add(_, &_->fds, _->fds[_->fds[0]] + 1);
+
+  for (;;)
     {
-      if (bind.host && bind.host[0])
-        {
-          struct addrinfo	*ai;
+      int	*fds;
 
-          for (ai=PFD_addr_first(_, &bind); ai; ai=PFD_addr_next(_, &bind))
-            if (!PFD_open_tcp_connect(_, &dest, ai, create))
-              goto ok;
+      if (!PFD_dial(_, d, n))
+        {
+          fds		= 0;
+          for (i=0; i<n; i++)
+            PFD_ints_add(_, &fds, d[i].fd);
+          PFD_recfds(_, fds);
+
+          _->done	= 0;
+          PFD_exec(_, -1, -1);
+          if (!_->ret)
+            break;
+          for (i=0; i<n; i++)
+            {
+              close(d[i].fd);
+              d[i].fd	= -1;
+              d[i].err	= 0;
+            }
         }
-     else if (!PFD_open_tcp_connect(_, &dest, NULL, create))
-       goto ok;
-
-    } while (!PFD_retry(_, &retry));
-  PFD_OOPS(_, "open_tcp() error: %s", _->sockname);
+      if (PFD_retry(_, &retry))
+        for (i=0; ; i++)
+          if (d[i].fd<0)
+            {
+              errno	= d[i].err;
+              if (!errno)
+                PFD_OOPS(_, "command failed: %s", _->cmd[0]);
+              PFD_OOPS(_, "cannot connect to %s", d[i].name);
+            }
+    }
 
-ok:
-  PFD_addr_free(_, &bind);
-  PFD_addr_free(_, &dest);
+  for (i=0; i<n; i++)
+    {
+      PFD_addr_free(_, &d[i].addr);
+      PFD_addr_free(_, &d[i].bind);
+    }
+  PFD_free(_, d);
+  PFD_free(_, names);
 }
 
 P(open_fork, void, int create)
@@ -1125,6 +3563,7 @@ P(open_fork, void, int create)
 P(open, void, int create)
 {
   PFD_getsockname(_);
+  PFD_rendezvous(_, create);
 
   /* Numeric socket: use given FD	*/
   if (isdigit(_->sockname[0]))
@@ -1138,6 +3577,8 @@ P(open, void, int create)
           break;
     }
 
+  if (create<0 && strchr(_->sockname, ','))
+    return PFD_open_multi(_);
   if (create<0)
     switch (_->sockname[0])
       {
@@ -1231,19 +3672,35 @@ P(usage, void)
         "	success	exec cmd on success\n"
         "	error	exec cmd on error\n"
         "	fork	exec cmd after socket established (default for d)\n"
+        "	fork	twice for d: start cmd before connect, it gets the socket via a socketpair\n"
+        "	gamble	d: try the better of two random backends first\n"
         "	use	use the given FDs for passing (the other) FDs (d and p).  Default: 0\n"
         "	keep	keep passed FDs open for forked cmd ('i' only)\n"
+        "	keep	p: persistent relay, forward all batches which follow\n"
         "	verbose	enable additional output to STDERR\n"
+        "	nonce	connect sends $PASSFD_NONCE, accept checks it (created if empty)\n"
+        "	quiet	do not set PASSFD_ environment for cmd\n"
+        "	mptcp	create TCP sockets as MPTCP (fallback to TCP), $PASSFD_MPTCP adds endpoints\n"
         "mode:\n"
+        "	bank	keep N connections to host:port, hand one out per connect to socket\n"
         "	direct	connect to socket, exec cmd with FD, if ok pass socket to 'use'\n"
         "	in	create new socket, wait for conn, remove socket, pass FDs, terminate\n"
+        "	jobs	run the operations read from socket (file, default STDIN) concurrently\n"
         "	out	connect to socket, receive FDs, exec cmd with args and received FDs\n"
         "	pass	connect to socket, receive FDs, sort FDs, pass FDs to 'use'\n"
         "socket:\n"
         "	'-' same as 0, number, @abstract, path\n"
-        "	for 'd' it can also be [host]:port[@bind] (path must start with . or /)\n"
+        "	'@' alone: random @abstract name (exported as PASSFD_SOCK), connect uses $PASSFD_SOCK\n"
+        "	for 'd' it can also be [host]:port[|[host]:port..][@bind] (path must start with . or /)\n"
+        "	for 'b' it is followed by [host]:port and the pool size N (default 4)\n"
+        "	for 'j' it is a file or FD, followed by the max parallel ops (default 0: all)\n"
+        "fds:\n"
+        "	number, range A-B[/step], all-open, $ENV (space separated list of those)\n"
         "notes:\n"
         "	-1 is a special value, used for undefined/unlimited etc.\n"
+#ifdef	PASSFD_NUMERIC
+        "	built with PASSFD_NUMERIC: hosts must be numeric addresses\n"
+#endif
         , _->arg0);
 }
 
@@ -1255,7 +3712,7 @@ P(setopt, char * const *, char * const * argv)
   for (;;)
     {
       if (!*argv)
-        PFD_OOPS(_, "missing mode.  One of: d i o p  (Use h for help)");
+        PFD_OOPS(_, "missing mode.  One of: b d i j o p  (Use h for help)");
       switch (**argv)
         {
         default:	PFD_OOPS(_, "invalid/unknown argument: %c", **argv);
@@ -1267,10 +3724,16 @@ P(setopt, char * const *, char * const * argv)
         case 'c':	_->connect	= 1;			break;
         /*d*/
         case 'e':	_->onerror	= 1;			break;
-        case 'f':	_->dofork	= 1;			break;
+        case 'f':	_->speculate	= _->dofork;		/* f f	*/
+                	_->dofork	= 1;			break;
+        case 'g':	_->gamble	= 1;			break;
         /*hi*/
         case 'k':	_->keepfds	= 1;			break;
-        /*lop*/
+        /*l*/
+        case 'm':	_->mptcp	= 1;			break;
+        case 'n':	_->nonce	= "";			break;
+        /*op*/
+        case 'q':	_->quiet	= 1;			break;
         case 'r':	argv		= PFD_Sretry(_, argv);	continue;
         case 's':	_->onsuccess	= 1;			break;
         case 't':	argv		= PFD_Stmeout(_, argv);	continue;
@@ -1279,8 +3742,10 @@ P(setopt, char * const *, char * const * argv)
         case 'v':	_->verbose	= 1;			break;
 
         /* mode	*/
+        case 'b':
         case 'd':
         case 'i':
+        case 'j':
         case 'o':
         case 'p':
         case 'x':
@@ -1293,232 +3758,1095 @@ P(setopt, char * const *, char * const * argv)
     }
 }
 
-/* options.. mode socket fds.. -- cmd args..
- * -------------- ^^^^^^
+/* options.. mode socket fds.. -- cmd args..
+ * -------------- ^^^^^^
+ */
+P(setsock, char * const *, char * const * argv)
+{
+  PFD_sockname(_, *argv ? *argv++ : "0");
+  if (_->mode == 'b')
+    {
+      if (!*argv)
+        PFD_OOPS(_, "mode b needs a destination: [host]:port");
+      _->dest	= *argv++;
+      _->count	= *argv && strcmp(*argv, "--") ? PFD_int(_, *argv++) : 4;
+    }
+  if (_->mode == 'j')
+    _->count	= *argv && strcmp(*argv, "--") ? PFD_int(_, *argv++) : 0;
+  return argv;
+}
+
+/* NAME[/TARGET]=SRC
+ * returns SRC, or s if it has no such prefix
+ */
+P(fdname, const char *, const char *s)
+{
+  size_t	len;
+
+  len	= strcspn(s, "=,:@$");
+  return len && s[len] == '=' ? s+len+1 : s;
+}
+
+P(fdmeta_grow, struct pfdwire_fd *, struct pfdwire_fd *m, int from, int to)
+{
+  m	= PFD_realloc(_, m, to * sizeof *m);
+  for (; from<to; from++)
+    {
+      m[from].target	= -1;
+      m[from].type	= 0;
+      m[from].name[0]	= 0;
+    }
+  return m;
+}
+
+/* Apply NAME[/TARGET]= to the fds from index 'from' on.
+ * Following FDs (of an FD type) get the same name and the next targets.
+ */
+P(fdmeta, void, const char *s, int from)
+{
+  size_t	len;
+  int		target, i;
+
+  len		= strcspn(s, "/=");
+  target	= -1;
+  if (s[len] == '/')
+    {
+      char	*tmp;
+
+      tmp	= PFD_dup(_, s+len+1);
+      tmp[strcspn(tmp, "=")]	= 0;
+      target	= PFD_int(_, tmp);
+      PFD_free(_, tmp);
+    }
+  if (len >= PFDWIRE_NAME)
+    PFD_OOPS(_, "FD name too long: %.*s", (int)len, s);
+  for (i=from; i < _->fds[0]; i++)
+    {
+      memcpy(_->fdmeta[i].name, s, len);
+      _->fdmeta[i].name[len]	= 0;
+      _->fdmeta[i].target	= target<0 ? -1 : target + i-from;
+    }
+}
+
+/* options.. mode socket fds.. -- cmd args..
+ * --------------------- ^^^^^
+ */
+P(setfds, char * const *, char * const * argv)
+{
+  const char	*src;
+  int		n, nmeta;
+
+  nmeta	= 0;
+  argv	= PFD_getints(_, argv, &_->fds);
+  while (*argv && ((src = PFD_fdname(_, *argv)) != *argv || isalpha(**argv)))
+    {
+      if (_->mode != 'i')
+        PFD_OOPS(_, "FD types and names only work with mode i: %s", *argv);
+      n	= _->fds[0];
+      if (isalpha(*src))
+        PFD_factory(_, &_->fds, src);
+      else if (PFD_getint(_, &_->fds, src) || _->fds[0] == n)
+        PFD_OOPS(_, "missing FD: %s", *argv);
+      if (src != *argv)
+        {
+          _->fdmeta	= PFD_fdmeta_grow(_, _->fdmeta, nmeta, _->fds[0]);
+          nmeta		= _->fds[0];
+          PFD_fdmeta(_, *argv, n);
+        }
+      argv	= PFD_getints(_, argv+1, &_->fds);
+    }
+  if (_->fdmeta)
+    _->fdmeta	= PFD_fdmeta_grow(_, _->fdmeta, nmeta, _->fds[0]);
+  return argv;
+}
+
+
+/* options.. mode socket fds.. -- cmd args..
+ * ------------------------------ ^^^^^^^^^^
+ */
+P(setcmd, void, char * const * argv)
+{
+  _->cmd	= argv;
+}
+
+
+/***********************************************************************
+ * Implementation
+ **********************************************************************/
+
+/* Options sanity checks
+ */
+P(check, const char *)
+{
+  if (_->accept && _->connect)
+    return "cannot use connect and accept at the same time";
+  if ((_->onsuccess || _->onerror) && _->dofork)
+    return "Option f cannot be used together with s or e";
+  if ((_->mode == 'b' || _->mode == 'j') && _->cmd)
+    return "modes b and j do not run a command";
+  if (_->mode == 'b' && _->fds && _->fds[0])
+    return "mode b takes a single number of connections, not FDs";
+  if (_->mode == 'j' && _->fds && _->fds[0])
+    return "mode j takes a single number of operations, not FDs";
+  if (_->speculate && (_->mode != 'd' || !_->cmd))
+    return "Option f twice needs mode d and a command";
+  /* TODO XXX TODO missing additional tests here	*/
+  return 0;
+}
+
+P(args, void, char * const *argv)
+{
+  const char	*err;
+
+  argv	= PFD_setopt(_, argv);
+  argv	= PFD_setsock(_, argv);
+  argv	= PFD_setfds(_, argv);
+  if (*argv)
+    {
+      if (strcmp(*argv++, "--"))
+        PFD_OOPS(_, "Missing -- to separate cmd, seen: %s", *--argv);
+      PFD_setcmd(_, argv);
+    }
+
+  err	= PFD_check(_);
+  if (err)
+    PFD_OOPS(_, "%s", err);
+  if (_->nonce)
+    PFD_nonce_init(_);
+  if (_->mptcp)
+    PFD_mptcp_init(_);
+}
+
+
+/* returns 0 on success, -1 on error (see errno)
+ * meta (NULL for none) sends the names, see pfdwire.h
+ */
+P(sendfd_try, int, int sock, int *list, struct pfdwire_fd *meta, int flags)
+{
+  int			*fds, n;
+  char			buf[80];
+  uint64_t		t0, m0;
+
+  t0			= PFD_PROBE_T0(sendfd);
+  m0			= PFD_M0(_);
+  n			= PFD_ints(_, list, &fds);
+
+  PFD_V(_, "sending %d fds to %d:%s%s", n, sock, PFD_intlist(_, buf, sizeof buf, fds, n), meta ? " (named)" : "");
+  if (pfdwire_send(sock, fds, n, meta, flags))
+    {
+      PFD_T(_, SENDMSG, -1, sock);
+      return -1;
+    }
+  PFD_T(_, SENDMSG, sock, n);
+  PFD_PROBE(sendfd, sock, n, PFD_PROBE_NS(t0));
+  PFD_M(_, SEND, m0);
+  PFD_MC(_, fds_sent, n);
+  PFD_MC(_, batches_sent, 1);
+  return 0;
+}
+
+P(sendfd, void, int sock, int *list, struct pfdwire_fd *meta)
+{
+  if (PFD_sendfd_try(_, sock, list, meta, 0))
+    PFD_OOPS(_, "sendmsg() error socket %d", sock);
+}
+
+/* /usr/include/X11/Xtrans/Xtranssock.c
+ * The wire format is in pfdwire.h
+ *
+ * returns the received integer list,
+ * or NULL with *err on EOF (errno is 0) or error (see errno)
+ * *meta (if meta is not NULL) gets the names or NULL if none were sent
+ */
+P(recvfd_try, int *, int sock, struct pfdwire_fd **meta, int flags, const char **err)
+{
+  int			fds[1+PFDWIRE_MAX], *ret;
+  struct pfdwire_fd	tmp[PFDWIRE_MAX], *m;
+  int			n, i;
+  char			buf[80];
+  uint64_t		t0, m0;
+
+  t0			= PFD_PROBE_T0(recvfd);
+  m0			= PFD_M0(_);
+  for (;;)
+    {
+      m	= tmp;
+      if ((n = pfdwire_recv(sock, fds+1, PFDWIRE_MAX, flags, err, &m))>=0)
+        break;
+      PFD_T(_, RECVMSG, -1, sock);
+      if (errno != EINTR)
+        return 0;
+    }
+  if (!n)
+    {
+      *err	= "recvmsg() EOF, no FDs received";
+      errno	= 0;
+      return 0;
+    }
+
+  ret		= 0;
+  memcpy(PFD_ints_room(_, &ret, n), fds+1, n * sizeof *ret);
+  ret[0]	= n;
+
+  PFD_T(_, RECVMSG, sock, n);
+  PFD_PROBE(recvfd, sock, n, PFD_PROBE_NS(t0));
+  PFD_M(_, RECV, m0);
+  PFD_MC(_, fds_recv, n);
+  PFD_MC(_, batches_recv, 1);
+  PFD_V(_, "received %d fds from %d:%s", n, sock, PFD_intlist(_, buf, sizeof buf, ret+1, ret[0]));
+  for (i=0; m && i<n; i++)
+    PFD_V(_, "fd %d: name %s target %d type %s", ret[i+1], m[i].name, m[i].target, pfdwire_typename(m[i].type));
+  if (meta)
+    {
+      *meta	= 0;
+      if (m)
+        {
+          *meta	= PFD_alloc(_, n * sizeof *m);
+          memcpy(*meta, m, n * sizeof *m);
+        }
+    }
+  return ret;
+}
+
+P(recvfd_from, int *, int sock, struct pfdwire_fd **meta)
+{
+  const char	*err = "recvmsg() error";
+  int		*ret;
+
+  ret	= PFD_recvfd_try(_, sock, meta, 0, &err);
+  if (!ret)
+    PFD_OOPS(_, "%s", err);
+  return ret;
+}
+
+P(recvfd, void)
+{
+  struct pfdwire_fd	*meta;
+
+  PFD_recfds(_, PFD_recvfd_from(_, _->sock, &meta));
+  _->recmeta	= meta;
+}
+
+P(icmp, int, int a, int b)
+{
+  int	n, m;
+
+  n	= a<_->fds[0] ? _->fds[a+1] : a;
+  m	= b<_->fds[0] ? _->fds[b+1] : b;
+  return n - m;
+}
+
+P(iswap, void, int a, int b)
+{
+  int	tmp;
+
+  if (a < _->fds[0] && b < _->fds[0])
+    {
+      tmp		= _->fds[a+1];
+      _->fds[a+1]	= _->fds[b+1];
+      _->fds[b+1]	= tmp;
+    }
+
+  tmp			= _->recfds[a+1];
+  _->recfds[a+1]	= _->recfds[b+1];
+  _->recfds[b+1]	= tmp;
+
+  if (_->recmeta)
+    {
+      struct pfdwire_fd	m;
+
+      m			= _->recmeta[a];
+      _->recmeta[a]	= _->recmeta[b];
+      _->recmeta[b]	= m;
+    }
+}
+
+/* Sort *list according to *sort
+ *
+ * Both are fdlists.
+ */
+P(sorter, void)
+{
+  int n, m;
+
+  m	= _->fds[0];
+  n	= _->recfds[0];
+  if (n < m)
+    PFD_OOPS(_, "too few FDs received, got %d, expected at least %d", n, m);
+  mergesort(_, n, PFD_icmp, PFD_iswap, PFD_alloc, PFD_free);
+}
+
+/* Fan-out: pass the received FDs to all 'use' FDs in parallel
+ *
+ * sendmsg() does not block, so a stuck receiver only delays itself
+ * (up to the timeout).  Failing receivers are reported,
+ * this only is fatal if all fail.  Else the return code is 1.
+ */
+P(sendfds, void)
+{
+  struct pollfd	*pfd;
+  int		*fds, n, i, left, failed;
+  uint64_t	end;
+
+  n	= PFD_ints(_, _->uses, &fds);
+  if (n == 1)
+    return PFD_sendfd(_, *fds, _->recfds, _->recmeta);
+
+  pfd		= PFD_alloc(_, n * sizeof *pfd);
+  left		= 0;
+  failed	= 0;
+  for (i=0; i<n; i++)
+    {
+      pfd[i].fd		= fds[i];
+      pfd[i].events	= POLLOUT;
+      pfd[i].revents	= 0;
+      if (fds[i]<0)
+        failed++;	/* dropped by relay	*/
+      else if (!PFD_sendfd_try(_, fds[i], _->recfds, _->recmeta, MSG_DONTWAIT|PFD_MSG_NOSIGNAL))
+        pfd[i].fd	= -1;	/* done	*/
+      else if (errno == EAGAIN || errno == EWOULDBLOCK)
+        left++;
+      else
+        {
+          PFD_warn(_, "sendmsg() error socket %d", fds[i]);
+          pfd[i].fd	= -1;
+          failed++;
+          if (_->relay)
+            fds[i]	= -1;	/* drop it	*/
+        }
+    }
+
+  /* the relay waits for slow receivers (backpressure)	*/
+  end	= _->relay && !_->timeout ? UINT64_MAX : PFD_ns(_) + (_->timeout ? _->timeout : 10000) * 1000000ull;
+  while (left)
+    {
+      uint64_t	now;
+
+      now	= PFD_ns(_);
+      if (now >= end)
+        {
+          for (i=0; i<n; i++)
+            if (pfd[i].fd>=0)
+              {
+                errno	= ETIMEDOUT;
+                PFD_warn(_, "sendmsg() timeout socket %d", fds[i]);
+                failed++;
+              }
+          break;
+        }
+      if (poll(pfd, (nfds_t)n, end == UINT64_MAX ? -1 : (int)((end - now + 999999) / 1000000))<0 && errno != EINTR)
+        PFD_OOPS(_, "poll() error");
+      for (i=0; i<n; i++)
+        {
+          if (pfd[i].fd<0 || !pfd[i].revents)
+            continue;
+          if (PFD_sendfd_try(_, fds[i], _->recfds, _->recmeta, MSG_DONTWAIT|PFD_MSG_NOSIGNAL))
+            {
+              if (errno == EAGAIN || errno == EWOULDBLOCK)
+                continue;
+              PFD_warn(_, "sendmsg() error socket %d", fds[i]);
+              failed++;
+              if (_->relay)
+                fds[i]	= -1;	/* drop it	*/
+            }
+          pfd[i].fd	= -1;
+          left--;
+        }
+    }
+  PFD_free(_, pfd);
+
+  if (failed == n)
+    PFD_OOPS(_, "sending to all %d targets failed", n);
+  if (failed)
+    _->code	= 1;
+}
+
+/* Fan-in: connect to one of the comma separated sockets
+ * returns -1 if it is not there (yet)
+ */
+P(fanin_connect, int, const char *name)
+{
+  struct sockaddr_un	sun;
+  socklen_t		max;
+  const char		*save;
+  int			fd;
+
+  if (isdigit(*name))
+    return PFD_int(_, name);
+
+  save		= _->sockname;
+  _->sockname	= name;
+  max		= PFD_sun(_, &sun);
+  _->sockname	= save;
+
+  fd	= PFD_socket(_, AF_UNIX, SOCK_STREAM);
+  if (fd<0)
+    PFD_OOPS(_, "socket() error");
+  PFD_cloexec(_, fd, 0);
+  if (connect(fd, (struct sockaddr *)&sun, max))
+    {
+      PFD_T(_, CONNECT, -1, fd);
+      PFD_MC(_, connect_fails, 1);
+      PFD_E(_, "connect %d: %s", fd, name);
+      close(fd);
+      return -1;
+    }
+  PFD_T(_, CONNECT, fd, 0);
+  PFD_MC(_, connects, 1);
+  PFD_V(_, "connected %d to %s", fd, name);
+  PFD_connected(_, fd, AF_UNIX);
+  return fd;
+}
+
+/* PASSFD_SUPERVISOR=FD|path|@abstract: do not wait for the command.
+ * Send its pidfd followed by the FDs which would be passed on success
+ * (like "passfd i" does) to the supervisor and terminate.
+ * The supervisor waits for the pidfd and does the rest.
  */
-P(setsock, char * const *, char * const * argv)
+P(supervise, int, pid_t pid)
 {
-  PFD_sockname(_, *argv ? *argv++ : "0");
-  return argv;
+  struct PFD_retry	retry = {0};
+  const char		*name;
+  int			fd, sock, *list, n, i;
+
+  name	= getenv("PASSFD_SUPERVISOR");
+  if (!name || !*name)
+    return 0;
+#if defined(__linux__) && defined(SYS_pidfd_open)
+  /* The child is not reaped before we terminate, so pid is still ours */
+  fd	= syscall(SYS_pidfd_open, pid, 0);
+  if (fd<0)
+    PFD_OOPS(_, "pidfd_open() error: %d", (int)pid);
+#else
+  PFD_OOPS(_, "PASSFD_SUPERVISOR needs pidfd_open() (Linux)");
+#endif
+  n		= _->recfds ? _->recfds[0] : 0;
+  list		= 0;
+  PFD_ints_add(_, &list, fd);
+  for (i=0; i<n; i++)
+    PFD_ints_add(_, &list, _->recfds[i+1]);
+
+  while ((sock = PFD_fanin_connect(_, name))<0)
+    if (PFD_retry(_, &retry))
+      PFD_OOPS(_, "cannot connect supervisor: %s", name);
+  if (PFD_sendfd_try(_, sock, list, NULL, PFD_MSG_NOSIGNAL))
+    PFD_OOPS(_, "cannot send to supervisor: %s", name);
+  PFD_V(_, "supervisor %s got child %d", name, (int)pid);
+  if (!isdigit(*name))
+    close(sock);
+  close(fd);
+  PFD_free(_, list);
+
+  _->supervised	= 1;
+  _->ret	= 0;
+  return 1;
 }
 
-/* options.. mode socket fds.. -- cmd args..
- * --------------------- ^^^^^
+/* Fan-in: socket is a comma separated list.
+ *
+ * Connect to all of them (missing ones are retried together),
+ * then receive from each as soon as it sends.
+ * The received FDs are merged in the order of the list,
+ * so are their names and targets (see pfdwire.h).
  */
-P(setfds, char * const *, char * const * argv)
+P(fanin, void)
 {
-  return PFD_getints(_, argv, &_->fds);
-}
+  struct PFD_retry	retry = {0};
+  struct pollfd		*pfd;
+  struct pfdwire_fd	**meta, *recmeta;
+  char			*names, **name, *tmp, *x;
+  uint64_t		end;
+  int			**got, *fds, n, i, left, total;
+
+  names	= PFD_dup(_, _->sockname);
+  name	= PFD_alloc(_, (strlen(names)+1) * sizeof *name);
+  n	= 0;
+  for (tmp=strtok_r(names, ",", &x); tmp; tmp=strtok_r(NULL, ",", &x))
+    name[n++]	= tmp;
+  if (!n)
+    PFD_OOPS(_, "empty socket list: %s", _->sockname);
 
+  pfd	= PFD_alloc(_, n * sizeof *pfd);
+  got	= PFD_alloc(_, n * sizeof *got);
+  meta	= PFD_alloc(_, n * sizeof *meta);
+  for (i=0; i<n; i++)
+    {
+      pfd[i].fd		= -1;
+      pfd[i].events	= POLLIN;
+      got[i]		= 0;
+      meta[i]		= 0;
+    }
 
-/* options.. mode socket fds.. -- cmd args..
- * ------------------------------ ^^^^^^^^^^
+  for (;;)
+    {
+      for (left=i=0; i<n; i++)
+        if (pfd[i].fd<0 && (pfd[i].fd = PFD_fanin_connect(_, name[i]))<0)
+          left++;
+      if (!left)
+        break;
+      if (PFD_retry(_, &retry))
+        PFD_OOPS(_, "connect() error: %s", _->sockname);
+    }
+  PFD_V(_, "connected to %d sockets", n);
+  PFD_fork(_);
+
+  end	= PFD_ns(_) + (_->timeout ? _->timeout : 10000) * 1000000ull;
+  for (left=n; left; )
+    {
+      uint64_t	now;
+
+      now	= PFD_ns(_);
+      if (now >= end)
+        {
+          for (i=0; pfd[i].fd<0; i++);
+          errno	= ETIMEDOUT;
+          PFD_OOPS(_, "recvmsg() timeout: %s", name[i]);
+        }
+      if (poll(pfd, (nfds_t)n, (int)((end - now + 999999) / 1000000))<0)
+        {
+          if (errno == EINTR)
+            continue;
+          PFD_OOPS(_, "poll() error");
+        }
+      for (i=0; i<n; i++)
+        if (pfd[i].fd>=0 && pfd[i].revents)
+          {
+            got[i]	= PFD_recvfd_from(_, pfd[i].fd, &meta[i]);
+            if (!isdigit(*name[i]))
+              close(pfd[i].fd);
+            pfd[i].fd	= -1;
+            left--;
+          }
+    }
+
+  for (total=i=0; i<n; i++)
+    total	+= got[i][0];
+  fds		= 0;
+  PFD_ints_room(_, &fds, total);
+  fds[0]	= total;
+  recmeta	= 0;
+  for (i=0; i<n; i++)
+    if (meta[i] && !recmeta)
+      recmeta	= PFD_fdmeta_grow(_, NULL, 0, total);
+  for (total=i=0; i<n; i++)
+    {
+      memcpy(fds+1+total, got[i]+1, got[i][0] * sizeof *fds);
+      if (meta[i])
+        {
+          memcpy(recmeta+total, meta[i], got[i][0] * sizeof *recmeta);
+          PFD_free(_, meta[i]);
+        }
+      total	+= got[i][0];
+      PFD_free(_, got[i]);
+    }
+  PFD_recfds(_, fds);
+  _->recmeta	= recmeta;
+
+  PFD_free(_, meta);
+  PFD_free(_, got);
+  PFD_free(_, pfd);
+  PFD_free(_, name);
+  PFD_free(_, names);
+}
+
+/* Connect and receive FDs, from one or more sockets (o and p)
  */
-P(setcmd, void, char * const * argv)
+P(open_recv, void)
 {
-  _->cmd	= argv;
+  PFD_getsockname(_);
+  if (!strchr(_->sockname, ','))
+    {
+      PFD_open(_, 0);
+      PFD_recvfd(_);
+      return;
+    }
+  if (_->listen || _->accept)
+    PFD_OOPS(_, "l and a need a single socket, not a list: %s", _->sockname);
+  PFD_fanin(_);
 }
 
 
 /***********************************************************************
- * Implementation
+ * Connection pool (mode b)
+ *
+ * Keep N connections to dest established and hand out one to each
+ * client which connects to the Unix Domain Socket.  The replacement
+ * is dialed in the background, so clients never wait for DNS and
+ * the TCP handshake, unless the pool runs dry.
  **********************************************************************/
 
-/* Options sanity checks
- */
-P(check, const char *)
+struct PFD_slot
+  {
+    int		fd;		/* -1 if no connection	*/
+    int		ready;		/* connect() has finished	*/
+    unsigned	backoff;	/* ms, doubled on each failure	*/
+    uint64_t	due;		/* ns: next dial or connect timeout	*/
+  };
+
+struct PFD_pool
+  {
+    struct PFD_addr	dest;
+    int			n;
+    int			*waiting;	/* integer list of clients	*/
+    struct PFD_slot	*slot;
+  };
+
+P(keepalive, void, int fd)
 {
-  if (_->accept && _->connect)
-    return "cannot use connect and accept at the same time";
-  if ((_->onsuccess || _->onerror) && _->dofork)
-    return "Option f cannot be used together with s or e";
-  /* TODO XXX TODO missing additional tests here	*/
-  return 0;
+  int	on = 1;
+
+  if (setsockopt(fd, SOL_SOCKET, SO_KEEPALIVE, &on, sizeof on))
+    PFD_E(_, "cannot set SO_KEEPALIVE on %d", fd);
+#ifdef	TCP_KEEPIDLE
+  {
+    int	idle = 30, intvl = 10, cnt = 3;
+
+    setsockopt(fd, IPPROTO_TCP, TCP_KEEPIDLE, &idle, sizeof idle);
+    setsockopt(fd, IPPROTO_TCP, TCP_KEEPINTVL, &intvl, sizeof intvl);
+    setsockopt(fd, IPPROTO_TCP, TCP_KEEPCNT, &cnt, sizeof cnt);
+  }
+#endif
 }
 
-P(args, void, char * const *argv)
+/* A pooled connection is dead if the peer closed or reset it.
+ * Pending data (like an SSH banner) is left for the client.
+ */
+P(alive, int, int fd)
 {
-  const char	*err;
-
-  argv	= PFD_setopt(_, argv);
-  argv	= PFD_setsock(_, argv);
-  argv	= PFD_setfds(_, argv);
-  if (*argv)
-    {
-      if (strcmp(*argv++, "--"))
-        PFD_OOPS(_, "Missing -- to separate cmd, seen: %s", *--argv);
-      PFD_setcmd(_, argv);
-    }
+  char		c;
+  ssize_t	got;
 
-  err	= PFD_check(_);
-  if (err)
-    PFD_OOPS(_, "%s", err);
+  got	= recv(fd, &c, 1, MSG_PEEK|MSG_DONTWAIT);
+  return got>0 || (got<0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR));
 }
 
+P(pool_drop, void, struct PFD_slot *s, const char *why)
+{
+  PFD_V(_, "pool %d: %s", s->fd, why);
+  close(s->fd);
+  s->fd		= -1;
+  s->ready	= 0;
+  s->due	= 0;	/* dial the replacement right away	*/
+}
 
-union PFD_pass
-    {
-      struct cmsghdr		align;
-      char			buf[0];
-    };
+P(pool_fail, void, struct PFD_pool *p, struct PFD_slot *s, const char *why)
+{
+  PFD_MC(_, connect_fails, 1);
+  if (s->fd>=0)
+    PFD_pool_drop(_, s, why);
+  if (p->dest.pos)
+    PFD_addr_next(_, &p->dest);	/* try next address, NULL resolves again	*/
+  s->backoff	= s->backoff ? 2*s->backoff : 10;
+  if (s->backoff > 1000)
+    s->backoff	= 1000;
+  s->due	= PFD_ns(_) + s->backoff * 1000000ull;
+}
 
-P(sendfd, void, int sock, int *list)
+P(pool_dial, void, struct PFD_pool *p, struct PFD_slot *s)
 {
-  struct iovec		io = { 0 };
-  struct msghdr		msg = { 0 };
-  struct cmsghdr	*cmsg;
-  union PFD_pass	*u;
-  uint32_t		mbuf;
-  size_t		pl, tot;
-  int			*fds, n;
-  char			buf[80];
+  struct addrinfo	*ai;
+  int			fd;
 
-  n			= PFD_ints(_, list, &fds);
+  if (!p->dest.pos && !PFD_addr_first(_, &p->dest))
+    return PFD_pool_fail(_, p, s, "cannot resolve");
 
-  pl			= n * sizeof(int);
-  tot			= CMSG_SPACE(pl);
+  ai	= p->dest.pos;
+  fd	= PFD_socket(_, ai->ai_family, SOCK_STREAM);
+  if (fd<0)
+    return PFD_pool_fail(_, p, s, "socket() failed");
+  PFD_cloexec(_, fd, 0);
+  PFD_nonblock(_, fd);
+  PFD_keepalive(_, fd);
+  s->fd		= fd;
+  s->ready	= 0;
+  s->due	= PFD_ns(_) + (_->timeout ? _->timeout : 10000) * 1000000ull;
+  if (connect(fd, ai->ai_addr, ai->ai_addrlen) && errno != EINPROGRESS)
+    return PFD_pool_fail(_, p, s, "connect() failed");
+  PFD_V(_, "pool %d: dialing %s", fd, _->dest);
+}
+
+/* connect() finished (or failed)
+ */
+P(pool_ready, void, struct PFD_pool *p, struct PFD_slot *s)
+{
+  int		err;
+  socklen_t	len;
+
+  len	= sizeof err;
+  if (getsockopt(s->fd, SOL_SOCKET, SO_ERROR, &err, &len) || err)
+    return PFD_pool_fail(_, p, s, "connect failed");
+
+  PFD_T(_, CONNECT, s->fd, 0);
+  PFD_MC(_, connects, 1);
+  s->ready	= 1;
+  s->backoff	= 0;
+  PFD_V(_, "pool %d: connected to %s", s->fd, _->dest);
+}
 
-  u			= alloca(tot);
+/* Hand out ready connections to waiting clients
+ */
+P(pool_serve, void, struct PFD_pool *p)
+{
+  int	i, fds[2];
 
-  mbuf			= n;			/* send the number of FDs which will be passed	*/
-  io.iov_base		= &mbuf;		/* data to send	*/
-  io.iov_len		= sizeof mbuf;		/* length to send	*/
+  for (i=0; i<p->n && p->waiting[0]; i++)
+    {
+      struct PFD_slot	*s = &p->slot[i];
+      int		client;
 
-  /* man 3 cmsg	*/
-  msg.msg_iov		= &io;			/* iovs to pass	*/
-  msg.msg_iovlen	= 1;			/* iov count	*/
-  msg.msg_control	= u;			/* real control to pass	*/
-  msg.msg_controllen	= tot;			/* length of the control	*/
+      if (s->fd<0 || !s->ready)
+        continue;
+      if (!PFD_alive(_, s->fd))
+        {
+          PFD_pool_drop(_, s, "dead");
+          continue;
+        }
 
-  cmsg			= CMSG_FIRSTHDR(&msg);	/* fill the control	*/
-  cmsg->cmsg_level	= SOL_SOCKET;
-  cmsg->cmsg_type	= SCM_RIGHTS;
-  cmsg->cmsg_len	= CMSG_LEN(pl);
-  memcpy(CMSG_DATA(cmsg), fds, pl);
+      client	= p->waiting[1];
+      memmove(p->waiting+1, p->waiting+2, --p->waiting[0] * sizeof *p->waiting);
 
-  PFD_V(_, "sending %d fds to %d:%s", n, sock, PFD_intlist(_, buf, sizeof buf, fds, n));
-  if (sendmsg(sock, &msg, 0)<0)
-    PFD_OOPS(_, "sendmsg() error socket %d", sock);
+      fds[0]	= 1;
+      fds[1]	= s->fd;
+      PFD_blocking(_, s->fd);
+      if (PFD_sendfd_try(_, client, fds, NULL, PFD_MSG_NOSIGNAL))
+        {
+          PFD_nonblock(_, s->fd);
+          PFD_E(_, "pool: client %d gone", client);
+          i--;		/* connection still is fine	*/
+        }
+      else
+        {
+          PFD_pool_drop(_, s, "handed out");
+          PFD_pool_dial(_, p, s);
+        }
+      close(client);
+    }
 }
 
-/* /usr/include/X11/Xtrans/Xtranssock.c
+/* Listening socket, either an FD or a Unix Domain Socket
  */
-P(recvfd, void)
+P(pool_listen, void)
 {
-  struct msghdr msg	= {0};
-  struct iovec	io	= {0};
-  struct cmsghdr	*cmsg;
-  union PFD_pass	*u;
-  uint32_t		mbuf;
-  size_t		pl, tot;
-  ssize_t		sz;
-  char			buf[80];
+  struct sockaddr_un	sun;
+  socklen_t		max;
 
-  pl			= 255 * sizeof(int);
-  tot			= CMSG_SPACE(pl);
+  PFD_getsockname(_);
+  if (isdigit(_->sockname[0]))
+    _->sock	= PFD_int(_, _->sockname);
+  else
+    {
+      max	= PFD_sun(_, &sun);
+      PFD_sock(_, PFD_socket(_, AF_UNIX, SOCK_STREAM));
+      PFD_cloexec(_, _->sock, 0);
+      _->listen	= 1;	/* replace stale sockets	*/
+      if (PFD_bind_un(_, &sun, max) && PFD_bind_un(_, &sun, max))
+        PFD_OOPS(_, "cannot bind: %s", _->sockname);
+      if (listen(_->sock, SOMAXCONN))
+        PFD_OOPS(_, "listen() error: %s", _->sockname);
+    }
+  PFD_nonblock(_, _->sock);
+  PFD_V(_, "pool listen %d: %s", _->sock, _->sockname);
+}
 
-  u			= alloca(tot);
+P(main_b, void)
+{
+  struct PFD_pool	p = {{0}};
+  struct pollfd		*pfd;
+  char			*name;
+  int			i;
 
-  io.iov_base		= &mbuf;
-  io.iov_len		= sizeof mbuf;
+  PFD_V(_, "pass: bank");
+  p.n		= _->count;
+  if (p.n < 1)
+    PFD_OOPS(_, "pool size must be at least 1");
+  name		= PFD_dup(_, _->dest);
+  PFD_addr(_, &p.dest, name);
+  PFD_free(_, name);
 
-  msg.msg_iov		= &io;
-  msg.msg_iovlen	= 1;
-  msg.msg_control	= u;
-  msg.msg_controllen	= tot;
+  p.slot	= PFD_alloc(_, p.n * sizeof *p.slot);
+  pfd		= PFD_alloc(_, (p.n+1) * sizeof *pfd);
+  p.waiting	= 0;
+  PFD_ints_room(_, &p.waiting, 0);
+  for (i=0; i<p.n; i++)
+    {
+      p.slot[i].fd	= -1;
+      p.slot[i].ready	= 0;
+      p.slot[i].backoff	= 0;
+      p.slot[i].due	= 0;
+    }
 
-  cmsg			= CMSG_FIRSTHDR(&msg);
-  cmsg->cmsg_level	= SOL_SOCKET;
-  cmsg->cmsg_type	= SCM_RIGHTS;
-  cmsg->cmsg_len	= CMSG_LEN(pl);
+  PFD_pool_listen(_);
+  signal(SIGPIPE, SIG_IGN);	/* clients may go away	*/
 
   for (;;)
     {
-      sz		= recvmsg(_->sock, &msg, 0);
-      if (sz>0)
-        break;
-      if (errno != EINTR)
-        PFD_OOPS(_, "recvmsg() error");
-    }
-  if (sz != sizeof mbuf)
-    PFD_OOPS(_, "recvmsg() %d bytes expedted but %d bytes got", (int)sizeof mbuf, (int)sz);
+      uint64_t	now;
+      int	wait, fd;
+
+      now	= PFD_ns(_);
+      for (i=0; i<p.n; i++)
+        if (p.slot[i].fd<0 && p.slot[i].due <= now)
+          PFD_pool_dial(_, &p, &p.slot[i]);
+      PFD_pool_serve(_, &p);
+
+      pfd[0].fd		= _->sock;
+      pfd[0].events	= POLLIN;
+      wait		= -1;
+      now		= PFD_ns(_);
+      for (i=0; i<p.n; i++)
+        {
+          struct PFD_slot	*s = &p.slot[i];
 
-  cmsg	= CMSG_FIRSTHDR(&msg);
-  if (!cmsg)
-    PFD_OOPS(_, "recvmsg() no control message (no FDs?)");
-      int	n, *fds;
+          pfd[i+1].fd		= s->fd;
+#ifdef	POLLRDHUP
+          pfd[i+1].events	= s->ready ? POLLRDHUP : POLLOUT;
+#else
+          pfd[i+1].events	= s->ready ? 0 : POLLOUT;
+#endif
+          pfd[i+1].revents	= 0;
+          if (s->fd<0 || !s->ready)
+            {
+              int	ms;
 
-  if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS)
-    PFD_OOPS(_, "recvmsg() control message not SCM_RIGHTS");
+              ms	= s->due > now ? (int)((s->due - now + 999999) / 1000000) : 0;
+              if (wait<0 || ms<wait)
+                wait	= ms;
+            }
+        }
 
-  n	= cmsg->cmsg_len - CMSG_LEN(0);
-  if (n % sizeof *fds)
-    PFD_OOPS(_, "recvmsg() control message wrongly padded: %d", (int)n);
-  if (mbuf != n/sizeof *fds)
-    PFD_OOPS(_, "recvmsg() control message size mismatch: %d expected %u", (int)n, (unsigned)mbuf);
+      if (poll(pfd, (nfds_t)(p.n+1), wait)<0 && errno != EINTR)
+        PFD_OOPS(_, "poll() error");
 
-  fds		= PFD_alloc(_, n+sizeof (*fds));
-  fds[0]	= mbuf;
-  memcpy(fds+1, CMSG_DATA(cmsg), n);
-  PFD_recfds(_, fds);
+      now	= PFD_ns(_);
+      for (i=0; i<p.n; i++)
+        {
+          struct PFD_slot	*s = &p.slot[i];
 
-  cmsg	= CMSG_NXTHDR(&msg, cmsg);
-  if (cmsg)
-    PFD_OOPS(_, "unexpected multiple control messages");
+          if (s->fd<0)
+            continue;
+          if (!s->ready && pfd[i+1].revents)
+            PFD_pool_ready(_, &p, s);
+          else if (!s->ready && s->due <= now)
+            PFD_pool_fail(_, &p, s, "connect timeout");
+          else if (s->ready && pfd[i+1].revents)
+            PFD_pool_drop(_, s, "closed by peer");
+        }
 
-  PFD_V(_, "received %d fds:%s", mbuf, PFD_intlist(_, buf, sizeof buf, fds+1, fds[0]));
+      if (pfd[0].revents)
+        while ((fd = accept(_->sock, NULL, NULL))>=0)
+          {
+            PFD_T(_, ACCEPT, fd, _->sock);
+            PFD_MC(_, accepts, 1);
+            PFD_cloexec(_, fd, 0);
+            PFD_ints_add(_, &p.waiting, fd);
+            PFD_V(_, "pool: client %d", fd);
+          }
+    }
 }
 
-P(icmp, int, int a, int b)
+/***********************************************************************
+ * Batch (mode j)
+ *
+ * Read operations, one per line (or NUL terminated if the input
+ * contains NUL bytes), each in the usual form:
+ *
+ *	modifiers mode socket fds.. -- cmd args..
+ *
+ * Words are separated by blanks, '..' "..." and \ quote like in sh.
+ * Empty lines and lines starting with # are ignored.
+ *
+ * Each operation runs in a fork()ed child, not exec()ed, so startup is
+ * paid only once.  Operations run concurrently (up to N if given),
+ * as rendezvous partners must run at the same time.
+ * For each finished operation a status line is written to STDOUT:
+ *
+ *	number<TAB>code<TAB>operation
+ **********************************************************************/
+
+struct PFD_job
+  {
+    pid_t	pid;
+    unsigned	nr;
+    char	*op;
+  };
+
+struct PFD_batch
+  {
+    int			fd, sep, max, code;
+    unsigned		nr, running;
+    struct PFD_job	*job;
+    char		*buf;
+    size_t		fill, size;
+  };
+
+/* Split s in place into words, returns NULL terminated argv
+ */
+P(words, char **, char *s)
 {
-  int	n, m;
+  char	**argv, *d;
+  int	n, q;
 
-  n	= a<_->fds[0] ? _->fds[a+1] : a;
-  m	= b<_->fds[0] ? _->fds[b+1] : b;
-  return n - m;
+  argv	= PFD_alloc(_, (strlen(s)/2+2) * sizeof *argv);
+  for (n=0;; n++)
+    {
+      while (*s==' ' || *s=='\t' || *s=='\r' || *s=='\n')
+        s++;
+      if (!*s)
+        break;
+      argv[n]	= d = s;
+      for (q=0; *s && (q || !strchr(" \t\r\n", *s)); s++)
+        if (q != '\'' && *s == '\\' && s[1])
+          *d++	= *++s;
+        else if (!q && (*s=='\'' || *s=='"'))
+          q	= *s;
+        else if (q && *s==q)
+          q	= 0;
+        else
+          *d++	= *s;
+      if (q)
+        PFD_OOPS(_, "unterminated quote in: %s", argv[0]);
+      if (*s)
+        s++;
+      *d	= 0;
+    }
+  argv[n]	= 0;
+  return argv;
 }
 
-P(iswap, void, int a, int b)
+/* Wait for one operation, block if wanted
+ * returns 0 if nothing was reaped
+ */
+P(batch_reap, int, struct PFD_batch *b, int block)
 {
-  int	tmp;
-
-  tmp		= _->fds[a];
-  _->fds[a]	= _->fds[b];
-  _->fds[b]	= tmp;
+  struct PFD_job	*j;
+  pid_t			pid;
+  int			status, code;
+  unsigned		i;
 
-  tmp		= _->recfds[a];
-  _->recfds[a]	= _->recfds[b];
-  _->recfds[b]	= tmp;
+  while ((pid = waitpid((pid_t)-1, &status, block ? 0 : WNOHANG))<0 && errno == EINTR);
+  if (pid<=0)
+    return 0;
+  for (i=0, j=b->job; i<b->running && j->pid != pid; i++, j++);
+  if (i >= b->running)
+    return 1;	/* not ours	*/
+
+  code	= WIFEXITED(status) ? WEXITSTATUS(status) : WIFSIGNALED(status) ? 128+WTERMSIG(status) : 127;
+  PFD_V(_, "op %u pid %d: code %d", j->nr, (int)pid, code);
+  dprintf(1, "%u\t%d\t%s\n", j->nr, code, j->op);
+  if (code && !b->code)
+    b->code	= code;
+  PFD_free(_, j->op);
+  *j	= b->job[--b->running];
+  return 1;
 }
 
-/* Sort *list according to *sort
- *
- * Both are fdlists.
- */
-P(sorter, void)
+P(batch_run, void, struct PFD_batch *b, const char *op)
 {
-  int n, m;
+  char		*tmp, **argv;
+  pid_t		pid;
 
-  m	= _->fds[0];
-  n	= _->recfds[0];
-  if (n < m)
-    PFD_OOPS(_, "too few FDs received, got %d, expected at least %d", n, m);
-  mergesort(_, n, PFD_icmp, PFD_iswap, PFD_alloc, PFD_free);
+  tmp	= PFD_dup(_, op);
+  argv	= PFD_words(_, tmp);
+  if (!*argv || **argv == '#')
+    {
+      PFD_free(_, argv);
+      PFD_free(_, tmp);
+      return;
+    }
+  b->nr++;
+  while (b->max>0 && b->running >= (unsigned)b->max)
+    PFD_batch_reap(_, b, 1);
+
+  pid	= fork();
+  if (pid == (pid_t)-1)
+    PFD_OOPS(_, "fork() failed");
+  if (!pid)
+    {
+      static struct PFD_passfd	o;
+
+      if (b->fd > 2)
+        close(b->fd);
+      PFD_init(&o, _->arg0);
+      PFD_args(&o, argv);
+      PFD_main(&o);
+      exit(PFD_exit(&o));
+    }
+  PFD_MC(_, forks, 1);
+  PFD_T(_, FORK, 0, (int)pid);
+  PFD_V(_, "op %u pid %d: %s", b->nr, (int)pid, op);
+
+  b->job				= PFD_realloc(_, b->job, (b->running+1) * sizeof *b->job);
+  b->job[b->running].pid	= pid;
+  b->job[b->running].nr		= b->nr;
+  b->job[b->running].op		= PFD_dup(_, op);
+  b->running++;
+  PFD_free(_, argv);
+  PFD_free(_, tmp);
 }
 
-P(sendfds, void)
+P(main_j, void)
 {
-  int	*fds, n;
+  struct PFD_batch	b = {0};
+  char			*e;
+
+  PFD_V(_, "pass: jobs");
+  PFD_getsockname(_);
+  b.sep		= -1;
+  b.max		= _->count;
+  b.fd		= 0;
+  if (isdigit(_->sockname[0]))
+    b.fd	= PFD_int(_, _->sockname);
+  else if ((b.fd = open(_->sockname, O_RDONLY))<0)
+    PFD_OOPS(_, "cannot open %s", _->sockname);
+  PFD_cloexec(_, b.fd, 0);
 
-  for (n=PFD_ints(_, _->uses, &fds); --n>=0; )
-    PFD_sendfd(_, *fds++, _->recfds);
+  b.size	= 4096;
+  b.buf		= PFD_alloc(_, b.size);
+  for (;;)
+    {
+      ssize_t	got;
+
+      while (PFD_batch_reap(_, &b, 0));
+      if (b.fill+1 >= b.size)
+        b.buf	= PFD_realloc(_, b.buf, b.size *= 2);
+      got	= read(b.fd, b.buf+b.fill, b.size-b.fill-1);
+      if (got<0 && errno == EINTR)
+        continue;
+      if (got<0)
+        PFD_OOPS(_, "read error: %s", _->sockname);
+      if (b.sep<0 && got)
+        b.sep	= memchr(b.buf+b.fill, 0, got) ? 0 : '\n';
+      b.fill	+= got;
+      b.buf[b.fill]	= 0;
+      if (!got)
+        break;
+      while ((e = memchr(b.buf, b.sep, b.fill))!=0)
+        {
+          *e	= 0;
+          PFD_batch_run(_, &b, b.buf);
+          b.fill	-= ++e - b.buf;
+          memmove(b.buf, e, b.fill+1);
+        }
+    }
+  if (b.fill)
+    PFD_batch_run(_, &b, b.buf);
+  while (b.running)
+    PFD_batch_reap(_, &b, 1);
+
+  PFD_V(_, "%u ops", b.nr);
+  _->code	= b.code;
+  PFD_free(_, b.buf);
+  PFD_free(_, b.job);
 }
 
 P(main_d, void)
 {
   PFD_V(_, "pass: direct");
+  if (_->speculate)
+    PFD_speculate(_);
   PFD_open(_, -1);
-  PFD_sendfds(_);
+  if (!_->supervised)
+    PFD_sendfds(_);
 }
 
 P(main_i, void)
@@ -1526,24 +4854,187 @@ P(main_i, void)
   int	n, *fds;
 
   for (n=PFD_ints(_, _->fds, &fds); --n>=0; )
-    PFD_cloexec(_, fds[n], _->keepfds);
+    {
+      int	k, keep;
+
+      keep	= _->keepfds;
+      for (k=_->kept ? _->kept[0] : 0; !keep && k>0; k--)
+        keep	= _->kept[k] == fds[n];
+      PFD_cloexec(_, fds[n], keep);
+    }
   PFD_V(_, "pass: in");
   PFD_open(_, 1);
-  PFD_sendfd(_, _->sock, _->fds);
+  PFD_sendfd(_, _->sock, _->fds, _->fdmeta);
 }
 
 P(main_o, void)
 {
   PFD_V(_, "pass: out");
-  PFD_open(_, 0);
-  PFD_recvfd(_);
+  PFD_open_recv(_);
+}
+
+/* k p: forward one batch, our copies of the FDs are closed afterwards
+ *
+ * The sort permutes the keys in _->fds, too, so each batch is sorted
+ * against a copy of them.
+ */
+P(relay_batch, void, int *fds, struct pfdwire_fd *meta)
+{
+  int	i, *keys;
+
+  PFD_recfds(_, fds);
+  _->recmeta	= meta;
+  keys		= _->fds;
+  if (keys)
+    {
+      _->fds	= 0;
+      memcpy(PFD_ints_room(_, &_->fds, keys[0]), keys+1, keys[0] * sizeof *keys);
+      _->fds[0]	= keys[0];
+    }
+  PFD_sorter(_);
+  PFD_free(_, _->fds);
+  _->fds	= keys;
+  PFD_sendfds(_);
+  for (i=_->recfds[0]; i>0; i--)
+    close(_->recfds[i]);
+  PFD_recfds(_, NULL);
+}
+
+#ifndef	PFD_RELAY_BURST
+#define	PFD_RELAY_BURST	16	/* batches taken from one stream in a row	*/
+#endif
+
+/* k p: persistent relay, connections to upstream and downstream stay.
+ *
+ * With l or a the listening socket stays open, too, and each sender
+ * which connects is a stream of its own (which is kept in order).
+ * Else there is one upstream and this ends on its EOF.
+ * While the downstream is slow, no stream is read (backpressure).
+ * With n the nonce of a new stream is read as part of the loop,
+ * so a sender which does not send it only stalls itself.
+ */
+P(relay, void)
+{
+  struct pollfd		*pfd;
+  struct PFD_nonce	*st;
+  struct pfdwire_fd	*meta;
+  const char		*err;
+  uint64_t		now;
+  int			listener, *fds, n, max, i, k, wait;
+
+  listener	= _->listen || _->accept ? _->sock : -1;
+  max		= 8;
+  pfd		= PFD_alloc(_, max * sizeof *pfd);
+  st		= PFD_alloc(_, max * sizeof *st);
+  pfd[0].fd	= _->sock;
+  pfd[0].events	= POLLIN;
+  st[0].due	= 0;
+  n		= 1;
+  while (n)
+    {
+      wait	= -1;
+      now	= PFD_ns(_);
+      for (i=0; i<n; i++)
+        if (st[i].due)
+          {
+            k	= st[i].due > now ? (int)((st[i].due - now + 999999) / 1000000) : 0;
+            if (wait<0 || k<wait)
+              wait	= k;
+          }
+      if (poll(pfd, (nfds_t)n, wait)<0)
+        {
+          if (errno == EINTR)
+            continue;
+          PFD_OOPS(_, "poll() error");
+        }
+      now	= PFD_ns(_);
+      for (i=n; --i>=0; )
+        {
+          if (st[i].due)
+            {
+              k	= pfd[i].revents ? PFD_nonce_more(_, pfd[i].fd, &st[i]) : -1;
+              if (k<0 && now < st[i].due)
+                continue;
+              if (k<0)
+                PFD_E(_, "nonce not received on %d", pfd[i].fd);
+              if (k)
+                {
+                  close(pfd[i].fd);
+                  pfd[i]	= pfd[--n];
+                  st[i]		= st[n];
+                  continue;
+                }
+              st[i].due	= 0;
+              PFD_V(_, "relay stream %d", pfd[i].fd);
+              continue;
+            }
+          if (!pfd[i].revents)
+            continue;
+          if (pfd[i].fd == listener)
+            {
+              int	fd;
+
+              fd	= accept(listener, NULL, NULL);
+              PFD_T(_, ACCEPT, fd, listener);
+              if (fd<0)
+                {
+                  if (errno == EINTR || errno == EAGAIN || errno == EWOULDBLOCK || errno == ECONNABORTED)
+                    continue;
+                  PFD_OOPS(_, "accept() error: %s", _->sockname);
+                }
+              PFD_MC(_, accepts, 1);
+              PFD_cloexec(_, fd, 0);
+              if (n == max)
+                {
+                  pfd	= PFD_realloc(_, pfd, (max *= 2) * sizeof *pfd);
+                  st	= PFD_realloc(_, st, max * sizeof *st);
+                }
+              pfd[n].fd		= fd;
+              pfd[n].events	= POLLIN;
+              pfd[n].revents	= 0;
+              memset(&st[n], 0, sizeof *st);
+              if (_->nonce)
+                st[n].due	= now + (_->timeout ? _->timeout : 10000) * 1000000ull;
+              else
+                PFD_V(_, "relay stream %d", fd);
+              n++;
+              continue;
+            }
+          /* pipelined batches are taken without another poll()	*/
+          for (k=0; k<PFD_RELAY_BURST; k++)
+            {
+              err	= "recvmsg() error";
+              fds	= PFD_recvfd_try(_, pfd[i].fd, &meta, k ? MSG_DONTWAIT : 0, &err);
+              if (!fds)
+                break;
+              PFD_relay_batch(_, fds, meta);
+            }
+          if (k == PFD_RELAY_BURST || (k && (errno == EAGAIN || errno == EWOULDBLOCK)))
+            continue;
+          if (errno)
+            PFD_warn(_, "relay stream %d: %s", pfd[i].fd, err);
+          else
+            PFD_V(_, "relay stream %d: EOF", pfd[i].fd);
+          close(pfd[i].fd);
+          pfd[i]	= pfd[--n];
+          st[i]		= st[n];
+        }
+    }
+  PFD_free(_, st);
+  PFD_free(_, pfd);
 }
 
 P(main_p, void)
 {
   PFD_V(_, "pass: proxy");
-  PFD_open(_, 0);
-  PFD_recvfd(_);
+  if (_->keepfds)
+    {
+      _->relay	= 1;
+      PFD_open(_, 0);
+      PFD_relay(_);
+      return;
+    }
+  PFD_open_recv(_);
 
   PFD_sorter(_);
   PFD_sendfds(_);
@@ -1553,8 +5044,10 @@ P(main, void)
 {
   switch (_->mode)
     {
-    default:	PFD_INTERNAL("mode not d i o p: %c (%02x)", _->mode, _->mode);
+    default:	PFD_INTERNAL("mode not b d i j o p: %c (%02x)", _->mode, _->mode);
+    case 'b':	PFD_main_b(_);	break;
     case 'd':	PFD_main_d(_);	break;
+    case 'j':	PFD_main_j(_);	break;
     case 'i':	PFD_main_i(_);	break;
     case 'o':	PFD_main_o(_);	break;
     case 'p':	PFD_main_p(_);	break;
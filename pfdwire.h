@@ -0,0 +1,325 @@
+/* The passfd wire format, usable without passfd.h
+ *
+ * This Works is placed under the terms of the Copyright Less License,
+ * see file COPYRIGHT.CLL.  USE AT OWN RISK, ABSOLUTELY NO WARRANTY.
+ *
+ * One message is a uint32_t with the number of FDs,
+ * followed by the FDs as SCM_RIGHTS control message.
+ *
+ * Version 2 (named FDs) instead starts with PFDWIRE_MAGIC,
+ * followed by the header and one entry per FD (all host byte order):
+ *
+ *	uint32_t	PFDWIRE_MAGIC	(with the FDs as SCM_RIGHTS)
+ *	uint32_t	len		bytes after n
+ *	uint32_t	n		number of FDs
+ *	n times:	int32_t target, uint16_t type, uint8_t namelen, uint8_t 0
+ *	the names	(without NUL, namelen each)
+ *
+ * The magic is no valid count, so both versions are told apart by the first word.
+ * Version 2 needs a stream socket (the rest is read afterwards).
+ * Only send it if names or targets are given, as old receivers reject it.
+ *
+ * Needs <sys/socket.h> <sys/stat.h> <stdint.h> <string.h> <errno.h>
+ * All is inline, so unused functions do not warn.
+ */
+
+#ifndef	PFDWIRE_MAX
+#define	PFDWIRE_MAX	255	/* more than SCM_MAX_FD (253) on Linux	*/
+#endif
+
+#define	PFDWIRE_MAGIC	0x32444650	/* PFD2	*/
+#define	PFDWIRE_NAME	64		/* including NUL	*/
+#define	PFDWIRE_ENT	8		/* size of an entry on the wire	*/
+#define	PFDWIRE_BUF	(3*4 + PFDWIRE_MAX*(PFDWIRE_ENT + PFDWIRE_NAME-1))
+
+/* type hints, the receiver does not need to fstat() or getsockopt()	*/
+enum pfdwire_type
+  {
+    PFDWIRE_UNKNOWN,
+    PFDWIRE_FILE,
+    PFDWIRE_DIR,
+    PFDWIRE_FIFO,
+    PFDWIRE_CHR,
+    PFDWIRE_BLK,
+    PFDWIRE_STREAM,
+    PFDWIRE_DGRAM,
+    PFDWIRE_SEQPACKET,
+    PFDWIRE_LISTEN,		/* listening stream socket	*/
+    PFDWIRE_OTHER,		/* eventfd, timerfd, etc.	*/
+  };
+
+/* What is known about an FD besides the FD itself
+ */
+struct pfdwire_fd
+  {
+    int		target;			/* FD number wanted by the sender, -1 if none	*/
+    int		type;			/* enum pfdwire_type	*/
+    char	name[PFDWIRE_NAME];	/* "" if none	*/
+  };
+
+union pfdwire_cmsg
+  {
+    struct cmsghdr	align;
+    char		buf[CMSG_SPACE(PFDWIRE_MAX * sizeof(int))];
+  };
+
+static inline const char *
+pfdwire_typename(int type)
+{
+  static const char * const	names[] = { "unknown", "file", "dir", "fifo", "chr", "blk", "stream", "dgram", "seqpacket", "listen", "other" };
+
+  return type>=0 && type<(int)(sizeof names / sizeof *names) ? names[type] : names[0];
+}
+
+/* Type hint of an FD (done by the sender, once)
+ */
+static inline int
+pfdwire_type(int fd)
+{
+  struct stat	st;
+  socklen_t	len;
+  int		v;
+
+  if (fstat(fd, &st))
+    return PFDWIRE_UNKNOWN;
+  if (S_ISREG(st.st_mode))	return PFDWIRE_FILE;
+  if (S_ISDIR(st.st_mode))	return PFDWIRE_DIR;
+  if (S_ISFIFO(st.st_mode))	return PFDWIRE_FIFO;
+  if (S_ISCHR(st.st_mode))	return PFDWIRE_CHR;
+  if (S_ISBLK(st.st_mode))	return PFDWIRE_BLK;
+  if (!S_ISSOCK(st.st_mode))	return PFDWIRE_OTHER;
+
+  len	= sizeof v;
+  if (getsockopt(fd, SOL_SOCKET, SO_TYPE, &v, &len))
+    return PFDWIRE_UNKNOWN;
+  if (v == SOCK_DGRAM)		return PFDWIRE_DGRAM;
+  if (v == SOCK_SEQPACKET)	return PFDWIRE_SEQPACKET;
+  if (v != SOCK_STREAM)		return PFDWIRE_OTHER;
+#ifdef	SO_ACCEPTCONN
+  len	= sizeof v;
+  if (!getsockopt(fd, SOL_SOCKET, SO_ACCEPTCONN, &v, &len) && v)
+    return PFDWIRE_LISTEN;
+#endif
+  return PFDWIRE_STREAM;
+}
+
+/* Send fds[n] as one message, meta[n] may be NULL (bare count).
+ * Missing types (PFDWIRE_UNKNOWN) in meta are filled in.
+ *
+ * returns 0 on success, -1 on error (see errno)
+ */
+static inline int
+pfdwire_send(int sock, const int *fds, int n, struct pfdwire_fd *meta, int flags)
+{
+  struct msghdr		msg = {0};
+  struct iovec		io = {0};
+  struct cmsghdr	*cmsg;
+  union pfdwire_cmsg	u;
+  unsigned char		buf[PFDWIRE_BUF];
+  uint32_t		w[3];
+  size_t		len, nl;
+  int			i;
+
+  if (n<0 || n > PFDWIRE_MAX)
+    {
+      errno		= EINVAL;
+      return -1;
+    }
+
+  w[0]			= n;
+  len			= sizeof *w;
+  if (meta)
+    {
+      len		= sizeof w + n * PFDWIRE_ENT;
+      for (i=0; i<n; i++)
+        {
+          unsigned char	*e = buf + sizeof w + i * PFDWIRE_ENT;
+          int32_t	t = meta[i].target;
+          uint16_t	ty;
+
+          if (!meta[i].type)
+            meta[i].type	= pfdwire_type(fds[i]);
+          ty		= meta[i].type;
+          nl		= strnlen(meta[i].name, PFDWIRE_NAME-1);
+          memcpy(e, &t, 4);
+          memcpy(e+4, &ty, 2);
+          e[6]		= nl;
+          e[7]		= 0;
+          memcpy(buf+len, meta[i].name, nl);
+          len		+= nl;
+        }
+      w[0]		= PFDWIRE_MAGIC;
+      w[1]		= len - sizeof w;
+      w[2]		= n;
+    }
+  memcpy(buf, w, len < sizeof w ? len : sizeof w);
+
+  io.iov_base		= buf;
+  io.iov_len		= len;
+
+  msg.msg_iov		= &io;
+  msg.msg_iovlen	= 1;
+  msg.msg_control	= u.buf;
+  msg.msg_controllen	= CMSG_SPACE(n * sizeof(int));
+
+  cmsg			= CMSG_FIRSTHDR(&msg);
+  cmsg->cmsg_level	= SOL_SOCKET;
+  cmsg->cmsg_type	= SCM_RIGHTS;
+  cmsg->cmsg_len	= CMSG_LEN(n * sizeof(int));
+  memcpy(CMSG_DATA(cmsg), fds, n * sizeof(int));
+
+  while (io.iov_len)
+    {
+      ssize_t	sz;
+
+      sz	= sendmsg(sock, &msg, flags);
+      if (sz<0)
+        return -1;
+      /* rest of a long version 2 message on a stream socket	*/
+      flags			&= ~MSG_DONTWAIT;
+      io.iov_base		= (char *)io.iov_base + sz;
+      io.iov_len		-= sz;
+      msg.msg_control		= 0;
+      msg.msg_controllen	= 0;
+    }
+  return 0;
+}
+
+/* Read the rest of a version 2 message into meta[n]
+ * returns NULL or the error
+ */
+static inline const char *
+pfdwire_recv2(int sock, int n, struct pfdwire_fd *meta, int flags)
+{
+  unsigned char	buf[PFDWIRE_BUF];
+  uint32_t	w[2];		/* len, n	*/
+  size_t	off, pos;
+  ssize_t	sz;
+  int		i;
+
+  flags	= (flags & ~MSG_DONTWAIT) | MSG_WAITALL;	/* the FDs are here, so is the rest	*/
+  while ((sz = recv(sock, w, sizeof w, flags))<0 && errno == EINTR);
+  if (sz != sizeof w)
+    return "version 2 header short";
+  if (w[1] != (uint32_t)n)
+    return "control message size mismatch";
+  if (w[0] < (uint32_t)n * PFDWIRE_ENT || w[0] > sizeof buf)
+    return "version 2 header wrong length";
+  for (off=0; off < w[0]; off += sz)
+    {
+      while ((sz = recv(sock, buf+off, w[0]-off, flags))<0 && errno == EINTR);
+      if (sz<=0)
+        return "version 2 message short";
+    }
+
+  pos	= n * PFDWIRE_ENT;
+  for (i=0; i<n; i++)
+    {
+      const unsigned char	*e = buf + i * PFDWIRE_ENT;
+      int32_t			t;
+      uint16_t			ty;
+
+      memcpy(&t, e, 4);
+      memcpy(&ty, e+4, 2);
+      if (e[6] >= PFDWIRE_NAME || pos + e[6] > off)
+        return "version 2 name too long";
+      meta[i].target	= t;
+      meta[i].type	= ty;
+      memcpy(meta[i].name, buf+pos, e[6]);
+      meta[i].name[e[6]]	= 0;
+      pos		+= e[6];
+    }
+  if (pos != off)
+    return "version 2 message wrong length";
+  return 0;
+}
+
+/* Receive one message into fds[max], both versions.
+ * If meta is not NULL, *meta must point to max entries to fill,
+ * *meta is kept for version 2, else set to NULL.
+ *
+ * returns the number of FDs
+ * returns 0 on EOF
+ * returns -1 on error, errno is set and *err (if not NULL) tells what failed.
+ * errno is EAGAIN or EWOULDBLOCK with MSG_DONTWAIT if there is nothing.
+ * EINTR is not retried.  Use MSG_CMSG_CLOEXEC (Linux) in flags if needed.
+ *
+ * On protocol errors, errno is EPROTO and received FDs are closed.
+ */
+static inline int
+pfdwire_recv(int sock, int *fds, int max, int flags, const char **err, struct pfdwire_fd **meta)
+{
+  struct msghdr		msg = {0};
+  struct iovec		io = {0};
+  struct cmsghdr	*cmsg;
+  union pfdwire_cmsg	u;
+  struct pfdwire_fd	*m;
+  uint32_t		mbuf;
+  ssize_t		sz;
+  const char		*e;
+  int			n, i;
+
+  m	= meta ? *meta : 0;
+  if (meta)
+    *meta		= 0;
+  if (max > PFDWIRE_MAX)
+    max			= PFDWIRE_MAX;
+
+  io.iov_base		= &mbuf;
+  io.iov_len		= sizeof mbuf;
+
+  msg.msg_iov		= &io;
+  msg.msg_iovlen	= 1;
+  msg.msg_control	= u.buf;
+  msg.msg_controllen	= CMSG_SPACE(max * sizeof(int));
+
+  sz	= recvmsg(sock, &msg, flags);
+  if (!sz)
+    return 0;
+  if (sz<0)
+    {
+      if (err)
+        *err	= "recvmsg() error";
+      return -1;
+    }
+
+  n	= 0;
+  e	= 0;
+  cmsg	= CMSG_FIRSTHDR(&msg);
+  if (cmsg && cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS)
+    {
+      n	= (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof *fds;
+      memcpy(fds, CMSG_DATA(cmsg), n * sizeof *fds);
+      if ((cmsg->cmsg_len - CMSG_LEN(0)) % sizeof *fds)
+        e	= "control message wrongly padded";
+    }
+  else
+    e	= cmsg ? "control message not SCM_RIGHTS" : "no control message (no FDs?)";
+
+  if (e)
+    ;
+  else if (sz != sizeof mbuf)
+    e	= "wrong message length";
+  else if (msg.msg_flags & MSG_CTRUNC)
+    e	= "control message truncated";
+  else if (CMSG_NXTHDR(&msg, cmsg))
+    e	= "unexpected multiple control messages";
+  else if (mbuf == PFDWIRE_MAGIC)
+    {
+      struct pfdwire_fd	tmp[PFDWIRE_MAX];
+
+      e	= msg.msg_flags & MSG_TRUNC ? "version 2 needs a stream socket" : pfdwire_recv2(sock, n, m ? m : tmp, flags);
+      if (!e && m)
+        *meta	= m;
+    }
+  else if (mbuf != (uint32_t)n)
+    e	= "control message size mismatch";
+  if (!e)
+    return n;
+
+  for (i=n; --i>=0; close(fds[i]));
+  if (err)
+    *err	= e;
+  errno	= EPROTO;
+  return -1;
+}
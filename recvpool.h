@@ -0,0 +1,494 @@
+/* Receive passed FDs in-process and dispatch them to worker threads
+ *
+ * This Works is placed under the terms of the Copyright Less License,
+ * see file COPYRIGHT.CLL.  USE AT OWN RISK, ABSOLUTELY NO WARRANTY.
+ *
+ * For servers which get connections handed over by passfd
+ * (like "passfd c i SOCK FD" or "passfd u SOCKFD d ..").
+ * Link with -pthread.  The wire format is in pfdwire.h.
+ *
+ *	rp = recvpool_new(workers, qsize, fn, user);
+ *	recvpool_add(rp, sock);		listening or connected Unix socket
+ *	recvpool_start(rp);
+ *	..
+ *	recvpool_stop(rp);		stops and joins the threads of the pool
+ *	recvpool_free(rp);		closes FDs not taken, frees rp
+ *
+ * With fn, each worker is a thread calling fn(user, worker, fd).
+ * With fn==NULL your threads call recvpool_get(rp, worker, wait).
+ * recvpool_stop() wakes them (recvpool_get() returns -1), join them
+ * before recvpool_free().
+ * The received FD belongs to the callee, it has FD_CLOEXEC set.
+ *
+ * How does this work?
+ *
+ * One receiver thread polls the sockets.  A readable socket is
+ * drained (MSG_DONTWAIT) until it would block, each FD is pushed to
+ * the queue of the next worker, preferring idle ones, waking it only
+ * if it sleeps.  Each worker has a bounded single-producer/multi-consumer
+ * ring: only the receiver pushes, so there is no owner push like in a
+ * Chase-Lev deque.  A worker takes from its own ring first, then steals
+ * from the others, before it goes to sleep.  There is no global lock.
+ *
+ * If all rings are full, the receiver stops reading (backpressure).
+ * As there is only one receiver, recvmsg() is serialized: more workers
+ * spread the work done with the FDs, but they do not take in more FDs.
+ */
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+
+#include "pfdwire.h"
+
+#ifndef	MSG_CMSG_CLOEXEC
+#define	MSG_CMSG_CLOEXEC	0	/* FD_CLOEXEC is set afterwards	*/
+#endif
+
+typedef void recvpool_fn(void *user, int worker, int fd);
+
+struct recvpool_q
+  {
+    _Atomic uint64_t	head, tail;
+    _Atomic int		*slot;
+    unsigned		mask;
+    _Atomic int		sleeping;
+    int			wake[2];	/* pipe to wake the worker	*/
+    struct recvpool	*rp;
+    pthread_t		thread;
+    int			running;
+    unsigned long	taken, stolen;	/* only touched by the worker	*/
+  };
+
+struct recvpool
+  {
+    int			n;
+    recvpool_fn		*fn;
+    void		*user;
+    struct recvpool_q	*q;
+    unsigned		next;
+
+    struct pollfd	*p;		/* [0] is ctl	*/
+    char		*accepted;	/* 1: accepted by us, 2: listening	*/
+    int			np, maxp;
+    int			ctl[2];
+    int			pend[PFDWIRE_MAX], npend, ipend;
+    _Atomic int		stop;
+    int			started, running;
+    pthread_t		receiver;
+
+    unsigned long	messages, fds, errors;	/* only touched by the receiver	*/
+  };
+
+static void
+recvpool_cloexec(int fd, int nonblock)
+{
+  fcntl(fd, F_SETFD, FD_CLOEXEC);
+  if (nonblock)
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+}
+
+static int recvpool_pop(struct recvpool_q *q);
+static void recvpool_close(struct recvpool *rp, int i);
+
+/* Close FDs which were not taken and free rp, after recvpool_stop()
+ */
+static void
+recvpool_free(struct recvpool *rp)
+{
+  int	i, fd;
+
+  if (rp->q)
+    for (i=0; i<rp->n; i++)
+      while ((fd = recvpool_pop(&rp->q[i])) >= 0)
+        close(fd);
+  for (; rp->ipend < rp->npend; close(rp->pend[rp->ipend++]));
+  for (i=rp->np; --i>0; recvpool_close(rp, i));
+
+  if (rp->q)
+    for (i=0; i<rp->n; i++)
+      {
+        struct recvpool_q	*q = &rp->q[i];
+
+        if (q->wake[0]>=0)
+          close(q->wake[0]);
+        if (q->wake[1]>=0)
+          close(q->wake[1]);
+        free(q->slot);
+      }
+  if (rp->ctl[0]>=0)
+    close(rp->ctl[0]);
+  if (rp->ctl[1]>=0)
+    close(rp->ctl[1]);
+  free(rp->q);
+  free(rp->p);
+  free(rp->accepted);
+  free(rp);
+}
+
+/* qsize is rounded up to a power of 2, default 1024
+ */
+static struct recvpool *
+recvpool_new(int workers, int qsize, recvpool_fn *fn, void *user)
+{
+  struct recvpool	*rp;
+  unsigned		size;
+  int			i;
+
+  if (workers<1)
+    workers	= 1;
+  for (size=2; (int)size < (qsize>0 ? qsize : 1024); size *= 2);
+
+  rp		= calloc(1, sizeof *rp);
+  if (!rp)
+    return 0;
+  rp->ctl[0]	= rp->ctl[1] = -1;
+  rp->n		= workers;
+  rp->fn	= fn;
+  rp->user	= user;
+  rp->maxp	= 16;
+  rp->q		= calloc(workers, sizeof *rp->q);
+  rp->p		= calloc(rp->maxp, sizeof *rp->p);
+  rp->accepted	= calloc(rp->maxp, sizeof *rp->accepted);
+  if (!rp->q || !rp->p || !rp->accepted)
+    {
+      recvpool_free(rp);
+      return 0;
+    }
+  for (i=0; i<workers; i++)
+    rp->q[i].wake[0]	= rp->q[i].wake[1] = -1;
+  for (i=0; i<workers; i++)
+    {
+      struct recvpool_q	*q = &rp->q[i];
+
+      q->rp	= rp;
+      q->mask	= size-1;
+      q->slot	= calloc(size, sizeof *q->slot);
+      if (!q->slot || pipe(q->wake))
+        {
+          recvpool_free(rp);
+          return 0;
+        }
+      recvpool_cloexec(q->wake[0], 1);
+      recvpool_cloexec(q->wake[1], 1);
+    }
+  if (pipe(rp->ctl))
+    {
+      recvpool_free(rp);
+      return 0;
+    }
+  recvpool_cloexec(rp->ctl[0], 1);
+  recvpool_cloexec(rp->ctl[1], 1);
+
+  rp->p[0].fd		= rp->ctl[0];
+  rp->p[0].events	= POLLIN;
+  rp->np		= 1;
+  return rp;
+}
+
+static int
+recvpool_poll_add(struct recvpool *rp, int fd, int accepted)
+{
+  if (rp->np >= rp->maxp)
+    {
+      struct pollfd	*p;
+      char		*a;
+
+      p	= realloc(rp->p, 2 * rp->maxp * sizeof *p);
+      if (p)
+        rp->p	= p;
+      a	= realloc(rp->accepted, 2 * rp->maxp * sizeof *a);
+      if (a)
+        rp->accepted	= a;
+      if (!p || !a)
+        return -1;
+      rp->maxp	*= 2;
+    }
+  rp->p[rp->np].fd		= fd;
+  rp->p[rp->np].events		= POLLIN;
+  rp->p[rp->np].revents		= 0;
+  rp->accepted[rp->np++]	= accepted;
+  return 0;
+}
+
+/* Add a listening or connected Unix Domain Socket, before recvpool_start().
+ * It is not closed by the pool (connections accepted by the pool are).
+ */
+static int
+recvpool_add(struct recvpool *rp, int sock)
+{
+  int		on = 0;
+  socklen_t	len = sizeof on;
+
+  if (rp->started)
+    {
+      errno	= EBUSY;
+      return -1;
+    }
+  if (getsockopt(sock, SOL_SOCKET, SO_ACCEPTCONN, &on, &len))
+    return -1;
+  recvpool_cloexec(sock, 1);
+  return recvpool_poll_add(rp, sock, on ? 2 : 0);
+}
+
+/* pop from the ring of worker w, -1 if empty	*/
+static int
+recvpool_pop(struct recvpool_q *q)
+{
+  uint64_t	h, t;
+  int		fd;
+
+  h	= atomic_load_explicit(&q->head, memory_order_acquire);
+  for (;;)
+    {
+      t	= atomic_load(&q->tail);
+      if (h >= t)
+        return -1;
+      fd	= atomic_load_explicit(&q->slot[h & q->mask], memory_order_relaxed);
+      if (atomic_compare_exchange_weak(&q->head, &h, h+1))
+        return fd;
+    }
+}
+
+/* push to the next worker, prefer sleeping ones.  -1 if all are full	*/
+static int
+recvpool_push(struct recvpool *rp, int fd)
+{
+  struct recvpool_q	*q;
+  uint64_t		t;
+  int			i, k, best;
+  char			c = 0;
+
+  best	= -1;
+  for (k=0; k<rp->n; k++)
+    {
+      i	= (rp->next + k) % rp->n;
+      q	= &rp->q[i];
+      if (atomic_load(&q->tail) - atomic_load_explicit(&q->head, memory_order_acquire) > q->mask)
+        continue;
+      if (best<0)
+        best	= i;
+      if (atomic_load_explicit(&q->sleeping, memory_order_relaxed))
+        {
+          best	= i;
+          break;
+        }
+    }
+  if (best<0)
+    return -1;
+
+  q	= &rp->q[best];
+  t	= atomic_load_explicit(&q->tail, memory_order_relaxed);
+  atomic_store_explicit(&q->slot[t & q->mask], fd, memory_order_relaxed);
+  atomic_store(&q->tail, t+1);
+  if (atomic_exchange(&q->sleeping, 0) && write(q->wake[1], &c, 1) < 0)
+    ;	/* pipe full: it wakes anyway	*/
+  rp->next	= best+1;
+  return 0;
+}
+
+/* Get the next FD for worker w, its own first, else steal one.
+ * With wait, sleep until there is one.
+ * returns -1 if there is none (or the pool stops)
+ */
+static int
+recvpool_get(struct recvpool *rp, int w, int wait)
+{
+  struct recvpool_q	*q = &rp->q[w];
+  struct pollfd		p;
+  char			buf[64];
+  int			fd, k;
+
+  for (;;)
+    {
+      if ((fd = recvpool_pop(q)) >= 0)
+        {
+          q->taken++;
+          return fd;
+        }
+      for (k=1; k<rp->n; k++)
+        if ((fd = recvpool_pop(&rp->q[(w+k) % rp->n])) >= 0)
+          {
+            q->stolen++;
+            return fd;
+          }
+      if (!wait || atomic_load(&rp->stop))
+        return -1;
+
+      /* Announce the sleep, then look again, see recvpool_push()	*/
+      atomic_store(&q->sleeping, 1);
+      for (k=0; k<rp->n; k++)
+        if (atomic_load(&rp->q[k].tail) > atomic_load(&rp->q[k].head))
+          break;
+      if (k<rp->n || atomic_load(&rp->stop))
+        {
+          atomic_store(&q->sleeping, 0);
+          continue;
+        }
+      p.fd	= q->wake[0];
+      p.events	= POLLIN;
+      poll(&p, 1, -1);
+      while (read(q->wake[0], buf, sizeof buf) > 0);
+    }
+}
+
+static void
+recvpool_close(struct recvpool *rp, int i)
+{
+  if (rp->accepted[i] == 1)
+    close(rp->p[i].fd);
+  rp->p[i]		= rp->p[--rp->np];
+  rp->accepted[i]	= rp->accepted[rp->np];
+}
+
+/* drain a connection until it would block, 1 on EOF/error	*/
+static int
+recvpool_drain(struct recvpool *rp, int sock)
+{
+  const char	*err;
+  int		n;
+
+  while (!rp->npend)
+    {
+      n	= pfdwire_recv(sock, rp->pend, PFDWIRE_MAX, MSG_DONTWAIT|MSG_CMSG_CLOEXEC, &err, NULL);
+      if (!n)
+        return 1;
+      if (n<0)
+        {
+          if (errno == EINTR)
+            continue;
+          if (errno == EAGAIN || errno == EWOULDBLOCK)
+            return 0;
+          rp->errors++;
+          return errno != EPROTO;	/* a bad message does not kill the connection	*/
+        }
+      rp->messages++;
+      rp->fds	+= n;
+      rp->npend	= n;
+      rp->ipend	= 0;
+      if (!MSG_CMSG_CLOEXEC)
+        for (; --n>=0; recvpool_cloexec(rp->pend[n], 0));
+      while (rp->ipend < rp->npend && !recvpool_push(rp, rp->pend[rp->ipend]))
+        rp->ipend++;
+      if (rp->ipend == rp->npend)
+        rp->npend	= 0;
+    }
+  return 0;
+}
+
+static void *
+recvpool_receiver(void *arg)
+{
+  struct recvpool	*rp = arg;
+  char			buf[64];
+  int			i, n;
+
+  while (!atomic_load(&rp->stop))
+    {
+      if (rp->npend)
+        {
+          while (rp->ipend < rp->npend && !recvpool_push(rp, rp->pend[rp->ipend]))
+            rp->ipend++;
+          if (rp->ipend == rp->npend)
+            rp->npend	= 0;
+        }
+      /* while FDs are pending, only wait for ctl and look again after 1ms	*/
+      n	= rp->npend ? 1 : rp->np;
+      if (poll(rp->p, n, rp->npend ? 1 : -1) <= 0)
+        continue;
+      if (rp->p[0].revents)
+        while (read(rp->ctl[0], buf, sizeof buf) > 0);
+      for (i=n; --i>0; )
+        {
+          int	fd;
+
+          if (!rp->p[i].revents)
+            continue;
+          if (rp->accepted[i] != 2)
+            {
+              if (recvpool_drain(rp, rp->p[i].fd))
+                recvpool_close(rp, i);
+              continue;
+            }
+          fd	= accept(rp->p[i].fd, NULL, NULL);
+          if (fd<0)
+            continue;
+          recvpool_cloexec(fd, 1);
+          if (recvpool_poll_add(rp, fd, 1))
+            close(fd);
+        }
+    }
+  return 0;
+}
+
+static void *
+recvpool_worker(void *arg)
+{
+  struct recvpool_q	*q = arg;
+  struct recvpool	*rp = q->rp;
+  int			fd;
+
+  for (;;)
+    {
+      fd	= recvpool_get(rp, q - rp->q, 1);
+      if (fd<0)
+        return 0;
+      rp->fn(rp->user, q - rp->q, fd);
+    }
+}
+
+static void recvpool_stop(struct recvpool *rp);
+
+/* On failure the threads started are stopped, rp still must be freed
+ */
+static int
+recvpool_start(struct recvpool *rp)
+{
+  int	i, e;
+
+  rp->started	= 1;
+  if (rp->fn)
+    for (i=0; i<rp->n; i++)
+      {
+        if ((e = pthread_create(&rp->q[i].thread, NULL, recvpool_worker, &rp->q[i])) != 0)
+          goto fail;
+        rp->q[i].running	= 1;
+      }
+  if ((e = pthread_create(&rp->receiver, NULL, recvpool_receiver, rp)) != 0)
+    goto fail;
+  rp->running	= 1;
+  return 0;
+
+fail:
+  recvpool_stop(rp);
+  errno	= e;
+  return -1;
+}
+
+/* Stop the receiver and the workers, wake threads in recvpool_get().
+ * The pool stays valid until recvpool_free().
+ */
+static void
+recvpool_stop(struct recvpool *rp)
+{
+  char	c = 0;
+  int	i;
+
+  atomic_store(&rp->stop, 1);
+  if (write(rp->ctl[1], &c, 1) < 0)
+    ;	/* pipe full: it wakes anyway	*/
+  if (rp->running)
+    pthread_join(rp->receiver, NULL);
+  rp->running	= 0;
+  for (i=0; i<rp->n; i++)
+    if (write(rp->q[i].wake[1], &c, 1) < 0)
+      ;
+  for (i=0; i<rp->n; i++)
+    if (rp->q[i].running)
+      {
+        pthread_join(rp->q[i].thread, NULL);
+        rp->q[i].running	= 0;
+      }
+}
@@ -0,0 +1,241 @@
+/* Shared memory byte ring between two processes, see "passfd i .. ring"
+ *
+ * This Works is placed under the terms of the Copyright Less License,
+ * see file COPYRIGHT.CLL.  USE AT OWN RISK, ABSOLUTELY NO WARRANTY.
+ *
+ * A ring is 3 FDs: the memory (memfd) and two doorbells (eventfd):
+ * "data" is rung by the writer if the reader sleeps,
+ * "space" is rung by the reader if the writer sleeps.
+ * There is one writer and one reader (SPSC).  For both directions use 2 rings.
+ *
+ *	struct shmring	r;
+ *	shmring_open(&r, memfd, datafd, spacefd);
+ *	shmring_send(&r, buf, len);	or	shmring_recv(&r, buf, len);
+ *	shmring_close(&r);
+ *
+ * shmring_write() and shmring_read() do not block (and return what was done).
+ * Doorbells are only rung if the other side sleeps, so streaming costs no syscalls.
+ * Before sleeping the other side spins SHMRING_SPIN times.
+ *
+ * Memory layout: header (page, or huge page), followed by the data (power of 2).
+ * All is inline, so unused functions do not warn.
+ */
+
+#include <stdatomic.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define	SHMRING_MAGIC	0x474e4952	/* RING	*/
+
+#ifndef	SHMRING_SPIN
+#define	SHMRING_SPIN	1000
+#endif
+
+struct shmring_hdr
+  {
+    uint32_t		magic, version;
+    uint64_t		off, size;	/* of the data	*/
+    char		pad0[64 - 24];
+    _Atomic uint64_t	head;		/* next to read, written by the reader	*/
+    _Atomic uint32_t	rwait;		/* reader sleeps	*/
+    char		pad1[64 - 12];
+    _Atomic uint64_t	tail;		/* next to write, written by the writer	*/
+    _Atomic uint32_t	wwait;		/* writer sleeps	*/
+  };
+
+struct shmring
+  {
+    struct shmring_hdr	*h;
+    unsigned char	*data;
+    uint64_t		mask;
+    size_t		len;
+    int			datafd, spacefd;
+  };
+
+/* Initialize the header of the memory (size of memfd is off+size).
+ * returns 0 or -1 (errno)
+ */
+static inline int
+shmring_format(int memfd, uint64_t off, uint64_t size)
+{
+  struct shmring_hdr	*h;
+
+  if (off < sizeof *h || !size || (size & (size-1)))
+    {
+      errno	= EINVAL;
+      return -1;
+    }
+  h	= mmap(NULL, off, PROT_READ|PROT_WRITE, MAP_SHARED, memfd, 0);
+  if (h == MAP_FAILED)
+    return -1;
+  memset(h, 0, sizeof *h);
+  h->off	= off;
+  h->size	= size;
+  h->version	= 1;
+  h->magic	= SHMRING_MAGIC;
+  munmap(h, off);
+  return 0;
+}
+
+/* returns 0 or -1 (errno)
+ */
+static inline int
+shmring_open(struct shmring *r, int memfd, int datafd, int spacefd)
+{
+  struct stat	st;
+  void		*m;
+
+  if (fstat(memfd, &st))
+    return -1;
+  m	= mmap(NULL, st.st_size, PROT_READ|PROT_WRITE, MAP_SHARED, memfd, 0);
+  if (m == MAP_FAILED)
+    return -1;
+  r->h		= m;
+  r->len	= st.st_size;
+  if (r->len < sizeof *r->h || r->h->magic != SHMRING_MAGIC || r->h->off + r->h->size > r->len)
+    {
+      munmap(m, r->len);
+      errno	= EINVAL;
+      return -1;
+    }
+  r->data	= (unsigned char *)m + r->h->off;
+  r->mask	= r->h->size - 1;
+  r->datafd	= datafd;
+  r->spacefd	= spacefd;
+  return 0;
+}
+
+static inline void
+shmring_close(struct shmring *r)
+{
+  munmap(r->h, r->len);
+  r->h	= 0;
+}
+
+static inline void
+shmring_ring(int fd)
+{
+  uint64_t	one = 1;
+
+  while (write(fd, &one, sizeof one) < 0 && errno == EINTR);
+}
+
+/* Sleep on the doorbell fd until *pos is no more seen (full or empty).
+ * returns -1 on error
+ */
+static inline int
+shmring_sleep(int fd, _Atomic uint32_t *wait, _Atomic uint64_t *pos, uint64_t seen)
+{
+  uint64_t	v;
+  int		i;
+
+  for (i=SHMRING_SPIN; --i>=0; )
+    if (atomic_load_explicit(pos, memory_order_acquire) != seen)
+      return 0;
+  atomic_store(wait, 1);
+  if (atomic_load(pos) != seen)
+    {
+      atomic_store(wait, 0);
+      return 0;
+    }
+  while (read(fd, &v, sizeof v) < 0)
+    if (errno != EINTR)
+      return -1;
+  atomic_store(wait, 0);
+  return 0;
+}
+
+static inline size_t
+shmring_write(struct shmring *r, const void *buf, size_t len)
+{
+  struct shmring_hdr	*h = r->h;
+  uint64_t		head, tail, o;
+  size_t		n, k;
+
+  tail	= atomic_load_explicit(&h->tail, memory_order_relaxed);
+  head	= atomic_load_explicit(&h->head, memory_order_acquire);
+  n	= h->size - (tail - head);
+  if (n > len)
+    n	= len;
+  if (!n)
+    return 0;
+  o	= tail & r->mask;
+  k	= h->size - o;
+  if (k > n)
+    k	= n;
+  memcpy(r->data + o, buf, k);
+  memcpy(r->data, (const char *)buf + k, n - k);
+  atomic_store(&h->tail, tail + n);
+  if (atomic_load(&h->rwait) && atomic_exchange(&h->rwait, 0))
+    shmring_ring(r->datafd);
+  return n;
+}
+
+static inline size_t
+shmring_read(struct shmring *r, void *buf, size_t len)
+{
+  struct shmring_hdr	*h = r->h;
+  uint64_t		head, tail, o;
+  size_t		n, k;
+
+  head	= atomic_load_explicit(&h->head, memory_order_relaxed);
+  tail	= atomic_load_explicit(&h->tail, memory_order_acquire);
+  n	= tail - head;
+  if (n > len)
+    n	= len;
+  if (!n)
+    return 0;
+  o	= head & r->mask;
+  k	= h->size - o;
+  if (k > n)
+    k	= n;
+  memcpy(buf, r->data + o, k);
+  memcpy((char *)buf + k, r->data, n - k);
+  atomic_store(&h->head, head + n);
+  if (atomic_load(&h->wwait) && atomic_exchange(&h->wwait, 0))
+    shmring_ring(r->spacefd);
+  return n;
+}
+
+/* Write everything, sleep if the ring is full.  returns 0 or -1
+ */
+static inline int
+shmring_send(struct shmring *r, const void *buf, size_t len)
+{
+  size_t	n;
+
+  while (len)
+    {
+      n	= shmring_write(r, buf, len);
+      if (n)
+        {
+          buf	= (const char *)buf + n;
+          len	-= n;
+        }
+      else if (shmring_sleep(r->spacefd, &r->h->wwait, &r->h->head,
+                             atomic_load_explicit(&r->h->tail, memory_order_relaxed) - r->h->size))
+        return -1;
+    }
+  return 0;
+}
+
+/* Read exactly len bytes, sleep if the ring is empty.  returns 0 or -1
+ */
+static inline int
+shmring_recv(struct shmring *r, void *buf, size_t len)
+{
+  size_t	n;
+
+  while (len)
+    {
+      n	= shmring_read(r, buf, len);
+      if (n)
+        {
+          buf	= (char *)buf + n;
+          len	-= n;
+        }
+      else if (shmring_sleep(r->datafd, &r->h->rwait, &r->h->tail, atomic_load(&r->h->head)))
+        return -1;
+    }
+  return 0;
+}